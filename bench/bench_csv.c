@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ndarray.h"
+
+#define CHECK_PTR(ptr)                                                       \
+    if (!(ptr)) {                                                            \
+        fprintf(stderr, "Allocation failed at %s:%d\n", __FILE__, __LINE__); \
+        exit(EXIT_FAILURE);                                                  \
+    }
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, const char* argv[])
+{
+    uint64_t n_samples  = (argc > 1) ? strtoull(argv[1], NULL, 10) : 500000;
+    uint64_t n_features = (argc > 2) ? strtoull(argv[2], NULL, 10) : 10;
+    const char* path    = "bench_data.csv";
+
+    // Full-precision doubles under a header line, like a pandas to_csv dump
+    srand(42);
+    FILE* file = fopen(path, "w");
+    CHECK_PTR(file);
+    for (uint64_t j = 0; j < n_features; j++) {
+        fprintf(file, (j + 1 < n_features) ? "Feature_%llu," : "Feature_%llu\n", (unsigned long long)j + 1);
+    }
+    for (uint64_t i = 0; i < n_samples * n_features; i++) {
+        fprintf(file, ((i + 1) % n_features) ? "%.17g," : "%.17g\n", (double)rand() / RAND_MAX * 4 - 2);
+    }
+    long bytes = ftell(file);
+    fclose(file);
+
+    // One value at a time with fscanf, the way the loader used to read
+    double start = now_sec();
+    file         = fopen(path, "r");
+    CHECK_PTR(file);
+    double* values = malloc(n_samples * n_features * sizeof(double));
+    CHECK_PTR(values);
+    fscanf(file, "%*[^\n]\n");
+    for (uint64_t i = 0; i < n_samples * n_features; i++) {
+        fscanf(file, "%lf,", &values[i]);
+    }
+    fclose(file);
+    double scanf_time = now_sec() - start;
+
+    start            = now_sec();
+    ndarray_t* array = ndarray_from_csv(path, 'd');
+    double load_time = now_sec() - start;
+    CHECK_PTR(array);
+
+    int mismatches = (array->dimensions[0] != n_samples || array->dimensions[1] != n_features);
+    for (uint64_t i = 0; i < n_samples * n_features && !mismatches; i++) {
+        mismatches += (((double*)array->data)[i] != values[i]);
+    }
+
+    // Same array as .npy: mapped on load, pages come in as the values are summed
+    const char* npy_path = "bench_data.npy";
+    if (ndarray_save(array, npy_path) != 0) {
+        fprintf(stderr, "ndarray_save failed\n");
+        return EXIT_FAILURE;
+    }
+    start             = now_sec();
+    ndarray_t* mapped = ndarray_load(npy_path);
+    CHECK_PTR(mapped);
+    double sum = 0;
+    for (uint64_t i = 0; i < n_samples * n_features; i++) {
+        sum += ((double*)mapped->data)[i];
+    }
+    double npy_time = now_sec() - start;
+    mismatches += memcmp(mapped->data, array->data, n_samples * n_features * sizeof(double)) != 0;
+    ndarray_free(mapped);
+    remove(npy_path);
+
+    printf("rows: %llu, features: %llu, %.1f MB\n", (unsigned long long)n_samples, (unsigned long long)n_features,
+           bytes / 1e6);
+    printf("fscanf loop     : %8.3f s, %7.1f MB/s\n", scanf_time, bytes / 1e6 / scanf_time);
+    printf("ndarray_from_csv: %8.3f s, %7.1f MB/s (%.2fx)\n", load_time, bytes / 1e6 / load_time, scanf_time / load_time);
+    printf("ndarray_load npy: %8.3f s, %7.1f MB/s (%.2fx), values summed to %.3f\n", npy_time, bytes / 1e6 / npy_time,
+           scanf_time / npy_time, sum);
+    printf("value mismatches: %d\n", mismatches);
+
+    remove(path);
+    free(values);
+    ndarray_free(array);
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
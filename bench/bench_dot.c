@@ -0,0 +1,97 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ndarray.h"
+
+#define CHECK_PTR(ptr)                                                       \
+    if (!(ptr)) {                                                            \
+        fprintf(stderr, "Allocation failed at %s:%d\n", __FILE__, __LINE__); \
+        exit(EXIT_FAILURE);                                                  \
+    }
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The loop ndarray_dot used to run: dtype checked per step, b walked down its columns,
+// a double accumulator for either dtype
+static void naive_dot(const ndarray_t* a, const ndarray_t* b, void* out)
+{
+    for (uint64_t i = 0; i < a->dimensions[0]; i++) {
+        for (uint64_t j = 0; j < b->dimensions[1]; j++) {
+            double sum = 0.0;
+            for (uint64_t k = 0; k < a->dimensions[1]; k++) {
+                if (a->dtype == 'd') {
+                    sum += ((double*)a->data)[i * a->dimensions[1] + k] * ((double*)b->data)[k * b->dimensions[1] + j];
+                } else if (a->dtype == 'f') {
+                    sum += ((float*)a->data)[i * a->dimensions[1] + k] * ((float*)b->data)[k * b->dimensions[1] + j];
+                }
+            }
+            if (a->dtype == 'd') {
+                ((double*)out)[i * b->dimensions[1] + j] = sum;
+            } else if (a->dtype == 'f') {
+                ((float*)out)[i * b->dimensions[1] + j] = (float)sum;
+            }
+        }
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    uint64_t m = (argc > 1) ? strtoull(argv[1], NULL, 10) : 20000;
+    uint64_t k = (argc > 2) ? strtoull(argv[2], NULL, 10) : 128;
+    uint64_t n = (argc > 3) ? strtoull(argv[3], NULL, 10) : 64;
+
+    // Rows of features times a projection matrix, then a square product
+    uint64_t shapes[2][3] = {{m, k, n}, {512, 512, 512}};
+    int failures          = 0;
+    for (int s = 0; s < 2; s++) {
+        for (int t = 0; t < 2; t++) {
+            char dtype        = t ? 'f' : 'd';
+            uint64_t rows     = shapes[s][0];
+            uint64_t inner    = shapes[s][1];
+            uint64_t cols     = shapes[s][2];
+            ndarray_t* a      = ndarray_random_noise(rows, inner, 0, 1, dtype);
+            ndarray_t* b      = ndarray_random_noise(inner, cols, 0, 1, dtype);
+            ndarray_t* result = ndarray_random_noise(rows, cols, 0, 1, dtype);
+            CHECK_PTR(a);
+            CHECK_PTR(b);
+            CHECK_PTR(result);
+
+            double start = now_sec();
+            naive_dot(a, b, result->data);
+            double naive_time = now_sec() - start;
+
+            start             = now_sec();
+            ndarray_t* tiled  = ndarray_dot(NULL, a, b);
+            double tiled_time = now_sec() - start;
+            CHECK_PTR(tiled);
+
+            double max_error = 0;
+            for (uint64_t i = 0; i < rows * cols; i++) {
+                double expected = t ? ((float*)result->data)[i] : ((double*)result->data)[i];
+                double value    = t ? ((float*)tiled->data)[i] : ((double*)tiled->data)[i];
+                max_error       = fmax(max_error, fabs(value - expected) / (fabs(expected) + 1));
+            }
+            failures += (max_error > (t ? 1e-4 : 1e-12));
+
+            double gflop = 2.0 * rows * inner * cols / 1e9;
+            printf("(%llu x %llu) . (%llu x %llu) '%c'\n", (unsigned long long)rows, (unsigned long long)inner,
+                   (unsigned long long)inner, (unsigned long long)cols, dtype);
+            printf("  naive loop : %8.3f s, %7.2f GFLOP/s\n", naive_time, gflop / naive_time);
+            printf("  ndarray_dot: %8.3f s, %7.2f GFLOP/s (%.1fx), max relative error %.2g\n", tiled_time, gflop / tiled_time,
+                   naive_time / tiled_time, max_error);
+
+            ndarray_free(tiled);
+            ndarray_free(result);
+            ndarray_free(b);
+            ndarray_free(a);
+        }
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,166 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "isolation_forest.h"
+#include "ndarray.h"
+
+#define CHECK_PTR(ptr)                                                       \
+    if (!(ptr)) {                                                            \
+        fprintf(stderr, "Allocation failed at %s:%d\n", __FILE__, __LINE__); \
+        exit(EXIT_FAILURE);                                                  \
+    }
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Bytes of the forest's saved model file
+static long model_file_size(isolation_forest* forest)
+{
+    const char* path = "bench_model.bin";
+    long size        = -1;
+    if (iforest_save(forest, path) == 0) {
+        FILE* file = fopen(path, "rb");
+        if (file != NULL && fseek(file, 0, SEEK_END) == 0) size = ftell(file);
+        if (file != NULL) fclose(file);
+    }
+    remove(path);
+    return size;
+}
+
+static double gaussian(double mean, double std)
+{
+    double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return mean + std * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+// Same shape as tests/test_data.csv: N(1, 1) points with 1% N(5, 1.5) outliers
+static ndarray_t* make_data(uint64_t n_samples, uint64_t n_features)
+{
+    uint64_t dims[2] = {n_samples, n_features};
+    ndarray_t* data  = ndarray_create(dims, 2, 'd');
+    CHECK_PTR(data);
+
+    uint64_t n_outliers = n_samples / 100;
+    double* values      = data->data;
+    for (uint64_t i = 0; i < n_samples; i++) {
+        for (uint64_t j = 0; j < n_features; j++) {
+            values[i * n_features + j] = (i < n_samples - n_outliers) ? gaussian(1, 1) : gaussian(5, 1.5);
+        }
+    }
+    return data;
+}
+
+int main(int argc, const char* argv[])
+{
+    uint64_t n_samples  = (argc > 1) ? strtoull(argv[1], NULL, 10) : 200000;
+    uint64_t n_features = (argc > 2) ? strtoull(argv[2], NULL, 10) : 5;
+    int num_threads     = (argc > 3) ? atoi(argv[3]) : 4;
+
+    srand(42);
+    ndarray_t* data = make_data(n_samples, n_features);
+    double* scores  = malloc(n_samples * sizeof(double));
+    double* batch   = malloc(n_samples * sizeof(double));
+    CHECK_PTR(scores);
+    CHECK_PTR(batch);
+
+    isolation_forest* forest = iforest_init(100, 256, n_features, 1, 0, 42);
+    CHECK_PTR(forest);
+    iforest_train(forest, data);
+
+    // Row at a time, tree after tree
+    double start = now_sec();
+    for (uint64_t i = 0; i < n_samples; i++) {
+        scores[i] = iforest_score(forest, (double*)data->data + i * n_features);
+    }
+    double single = now_sec() - start;
+
+    // Tiled kernel on one thread
+    start = now_sec();
+    iforest_score_batch(forest, data, batch);
+    double tiled = now_sec() - start;
+
+    int mismatches = 0;
+    for (uint64_t i = 0; i < n_samples; i++) {
+        if (scores[i] != batch[i]) mismatches++;
+    }
+
+    // Threshold decisions, stopping once the remaining trees cannot flip the label
+    long trees_walked = 0;
+    start             = now_sec();
+    for (uint64_t i = 0; i < n_samples; i++) {
+        int trees_evaluated;
+        int label = iforest_predict(forest, (double*)data->data + i * n_features, 0.6, &trees_evaluated);
+        if (label != (scores[i] > 0.6 ? -1 : 1)) mismatches++;
+        trees_walked += trees_evaluated;
+    }
+    double predict = now_sec() - start;
+
+    // Quantized copy of the same model: file size, speed and the scores it gives up
+    long full_bytes  = model_file_size(forest);
+    iforest_quantize(forest, 256);
+    long quant_bytes = model_file_size(forest);
+    double* quant    = malloc(n_samples * sizeof(double));
+    CHECK_PTR(quant);
+    start = now_sec();
+    iforest_score_batch(forest, data, quant);
+    double tiled_q    = now_sec() - start;
+    double max_error  = 0;
+    double mean_error = 0;
+    int flips         = 0;
+    for (uint64_t i = 0; i < n_samples; i++) {
+        double error = fabs(quant[i] - batch[i]);
+        max_error    = (error > max_error) ? error : max_error;
+        mean_error += error / n_samples;
+        flips += (quant[i] > 0.6) != (batch[i] > 0.6);
+    }
+    free(quant);
+    iforest_free(forest);
+
+    // Tiled kernel on float32 data, half the bytes per row
+    ndarray_t* data_f = ndarray_create(data->dimensions, 2, 'f');
+    CHECK_PTR(data_f);
+    for (uint64_t i = 0; i < n_samples * n_features; i++) {
+        ((float*)data_f->data)[i] = (float)((double*)data->data)[i];
+    }
+    forest = iforest_init(100, 256, n_features, 1, 0, 42);
+    CHECK_PTR(forest);
+    iforest_train(forest, data_f);
+    start = now_sec();
+    iforest_score_batch(forest, data_f, batch);
+    double tiled_f = now_sec() - start;
+    iforest_free(forest);
+    ndarray_free(data_f);
+
+    // Tiled kernel on num_threads threads
+    forest = iforest_init(100, 256, n_features, num_threads, 0, 42);
+    CHECK_PTR(forest);
+    iforest_train(forest, data);
+    start = now_sec();
+    iforest_score_batch(forest, data, batch);
+    double threaded = now_sec() - start;
+    iforest_free(forest);
+
+    printf("rows: %llu, features: %llu\n", (unsigned long long)n_samples, (unsigned long long)n_features);
+    printf("iforest_score loop        : %10.0f rows/sec\n", n_samples / single);
+    printf("iforest_predict loop      : %10.0f rows/sec (%.2fx), %.1f trees per row\n", n_samples / predict, single / predict,
+           (double)trees_walked / n_samples);
+    printf("iforest_score_batch (1 th): %10.0f rows/sec (%.2fx)\n", n_samples / tiled, single / tiled);
+    printf("iforest_score_batch f32   : %10.0f rows/sec (%.2fx)\n", n_samples / tiled_f, single / tiled_f);
+    printf("iforest_score_batch (%d th): %10.0f rows/sec (%.2fx)\n", num_threads, n_samples / threaded, single / threaded);
+    printf("quantized, 256 bins       : %10.0f rows/sec (%.2fx), model %ld -> %ld bytes\n", n_samples / tiled_q, single / tiled_q,
+           full_bytes, quant_bytes);
+    printf("quantized score error     : max %.6f, mean %.6f, %d labels flipped at 0.6\n", max_error, mean_error, flips);
+    printf("score mismatches: %d\n", mismatches);
+
+    free(scores);
+    free(batch);
+    ndarray_free(data);
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
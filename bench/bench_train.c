@@ -0,0 +1,72 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "isolation_forest.h"
+#include "ndarray.h"
+
+#define CHECK_PTR(ptr)                                                       \
+    if (!(ptr)) {                                                            \
+        fprintf(stderr, "Allocation failed at %s:%d\n", __FILE__, __LINE__); \
+        exit(EXIT_FAILURE);                                                  \
+    }
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Train a forest on one thread and score the data with it, returns the training time
+static double train(ndarray_t* data, int num_samples, int num_bins, double* scores)
+{
+    isolation_forest* forest = iforest_init(100, num_samples, (int)data->dimensions[1], 1, 0, 42);
+    CHECK_PTR(forest);
+    if (iforest_set_histogram(forest, num_bins) != 0) {
+        fprintf(stderr, "iforest_set_histogram failed\n");
+        exit(EXIT_FAILURE);
+    }
+    double start   = now_sec();
+    iforest_train(forest, data);
+    double elapsed = now_sec() - start;
+    iforest_score_batch(forest, data, scores);
+    iforest_free(forest);
+    return elapsed;
+}
+
+int main(int argc, const char* argv[])
+{
+    uint64_t n_samples  = (argc > 1) ? strtoull(argv[1], NULL, 10) : 100000;
+    uint64_t n_features = (argc > 2) ? strtoull(argv[2], NULL, 10) : 64;
+
+    ndarray_t* data = ndarray_random_noise(n_samples, n_features, 0, 1, 'd');
+    double* exact   = malloc(n_samples * sizeof(double));
+    double* binned  = malloc(n_samples * sizeof(double));
+    CHECK_PTR(data);
+    CHECK_PTR(exact);
+    CHECK_PTR(binned);
+
+    // Exact splits through row pointers against 256-bin histograms, for a few subsample sizes
+    int sample_sizes[3] = {256, 4096, 65536};
+    printf("rows: %llu, features: %llu, 100 trees, 1 thread\n", (unsigned long long)n_samples,
+           (unsigned long long)n_features);
+    for (int s = 0; s < 3; s++) {
+        int num_samples  = ((uint64_t)sample_sizes[s] < n_samples) ? sample_sizes[s] : (int)n_samples;
+        double plain     = train(data, num_samples, 0, exact);
+        double histogram = train(data, num_samples, 256, binned);
+        double max_diff  = 0;
+        for (uint64_t i = 0; i < n_samples; i++) {
+            double diff = fabs(exact[i] - binned[i]);
+            max_diff    = (diff > max_diff) ? diff : max_diff;
+        }
+        printf("num_samples %5d: exact %7.3f s, histogram %7.3f s (%.2fx), max score difference %.4f\n", num_samples,
+               plain, histogram, plain / histogram, max_diff);
+    }
+
+    free(exact);
+    free(binned);
+    ndarray_free(data);
+    return EXIT_SUCCESS;
+}
@@ -24,14 +24,99 @@ typedef struct itree_node itree_node;
 
 typedef struct isolation_forest isolation_forest;
 
+// contamination is the expected share of anomalies, in (0, 0.5], or 0 for "auto", see
+// iforest_threshold. returns NULL for any other contamination or if allocation fails
 isolation_forest* iforest_init(int num_trees, int num_samples, int num_features,
                                int num_threads, double contamination, uint32_t random_state);
 
+// split with random hyperplanes over extension_level + 1 features (Extended Isolation Forest)
+// instead of single-feature cuts. 0 is the standard model, levels are capped at num_features - 1.
+// takes effect on the next training. returns 0 on success, -1 on an invalid level
+int iforest_set_extension_level(isolation_forest* forest, int extension_level);
+
+// histogram training: every feature is cut once per training into num_bins (2 to 256) equal-width
+// bins and nodes scan 1-byte bin codes by row index instead of reading rows. splits fall on bin
+// edges, so trees approximate the exact ones. takes num_rows * num_features bytes while training,
+// extended splits and incremental training keep using exact values. 0 turns it off, takes effect
+// on the next training. returns 0 on success, -1 on an invalid bin count
+int iforest_set_histogram(isolation_forest* forest, int num_bins);
+
+// build the forest from data. threads scoring the forest meanwhile keep using the previous
+// model, the new one replaces it atomically and the old one is freed once they are done.
+// data must have num_features columns, other data is refused and the model kept.
 void iforest_train(isolation_forest* forest, ndarray_t* data);
 
+// number of threads that built subtrees split off large trees during the last iforest_train.
+// below num_threads with few large trees means the pool was not kept busy
+int iforest_subtree_workers(const isolation_forest* forest);
+
+// move the model of source, trained or loaded separately, into forest while other threads
+// keep scoring forest. source must not be in use elsewhere and is left without a model.
+// returns 0 on success, -1 if source has no model, a different num_samples or a model over a
+// different number of features. a rejected source keeps its model.
+int iforest_publish(isolation_forest* forest, isolation_forest* source);
+
 // get anomaly score for a data point
+// x is compared in the precision of the training data, a float model rounds x to float first
 double iforest_score(isolation_forest* forest, double* x);
 
+// get anomaly score for a float data point
+double iforest_score_f(isolation_forest* forest, float* x);
+
+// label x against a score threshold without computing the exact score: returns -1 (anomaly)
+// when iforest_score(forest, x) > threshold and 1 otherwise, or 0 if the forest has no model.
+// trees are walked in order and the walk stops as soon as the remaining trees cannot change
+// the outcome. if trees_evaluated is not NULL it receives the number of trees walked
+int iforest_predict(isolation_forest* forest, double* x, double threshold, int* trees_evaluated);
+
+// score threshold fitted when the model was built: the (1 - contamination) quantile of the
+// training scores, or 0.5 when contamination is 0 ("auto"). the offset_ of scikit-learn is
+// -iforest_threshold(forest). incremental training refits it over the window
+double iforest_threshold(isolation_forest* forest);
+
+// label every row of a 2D ndarray ('d' or 'f'): -1 when its score is above iforest_threshold,
+// 1 otherwise. rows stop early like iforest_predict and are split across num_threads.
+// labels must hold X->dimensions[0] values. returns 0 on success, -1 on invalid input
+int iforest_predict_batch(isolation_forest* forest, const ndarray_t* X, int* labels);
+
+// get anomaly scores for every row of a 2D ndarray ('d' or 'f'), rows are split across num_threads
+// out must hold X->dimensions[0] values. returns 0 on success, -1 on invalid input
+int iforest_score_batch(isolation_forest* forest, const ndarray_t* X, double* out);
+
+// configure incremental training before the first iforest_partial_fit: the window_size most
+// recent rows are kept and every batch replaces the trees_per_batch oldest trees.
+// defaults are 8 * num_samples rows and num_trees / 10 trees. returns 0 on success, -1 otherwise
+int iforest_set_window(isolation_forest* forest, uint64_t window_size, int trees_per_batch);
+
+// append the rows of X to the sliding window and return, the oldest trees are rebuilt from
+// the window by a background thread. scoring keeps using the current model until the new
+// one is published. the first batch on an untrained forest builds every tree.
+// returns 0 on success, -1 on invalid input
+int iforest_partial_fit(isolation_forest* forest, const ndarray_t* X);
+
+// wait until every batch passed to iforest_partial_fit is reflected in the model
+void iforest_flush(isolation_forest* forest);
+
+// replace the model by a compact copy for memory-bound deployments: split thresholds become
+// codes of at most max_bins bins per feature (quantiles of the model's thresholds, exact while a
+// feature has fewer than max_bins distinct ones) and leaf path lengths are rounded to 16 bits.
+// nodes take 4 bytes, or 6 with more than 256 bins or 255 features. rows are binned once, then
+// scored like with the full model; the fitted threshold is kept. extended models are not
+// supported and incremental training rebuilds a full model. returns 0 on success, -1 otherwise
+int iforest_quantize(isolation_forest* forest, int max_bins);
+
+// save a trained forest to a versioned binary file. returns 0 on success, -1 on failure
+int iforest_save(isolation_forest* forest, const char* path);
+
+// load a forest saved by iforest_save, node arrays are copied into memory
+isolation_forest* iforest_load(const char* path);
+
+// load a forest saved by iforest_save and score straight from a read-only mapping
+// of the file, with no parsing or copying. nodes are validated as iforest_load does,
+// in one pass over the mapping. The file must not change while mapped.
+isolation_forest* iforest_load_mmap(const char* path);
+
+// no other thread may use the forest once iforest_free is called
 void iforest_free(isolation_forest* forest);
 
 #endif // ISOLATION_FOREST_H
\ No newline at end of file
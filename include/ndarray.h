@@ -30,19 +30,44 @@ THE SOFTWARE.
 
 #include <stdint.h>
 
+// How ndarray_free releases an array's data
+typedef enum {
+    NDARRAY_OWNER_HEAP,  // Allocated with malloc, freed
+    NDARRAY_OWNER_MMAP,  // Inside a file mapping, unmapped
+    NDARRAY_OWNER_NONE,  // Borrowed from another array or the caller, left alone
+    NDARRAY_OWNER_USER   // Adopted from the caller, passed to release
+} ndarray_owner;
+
 typedef struct {
-    void* data;            // Pointer to array data
-    uint64_t* dimensions;  // Array shape
-    uint64_t* strides;     // Strides between elements
-    uint32_t nd;           // Number of dimensions
-    char dtype;            // Data type ('d' for double, 'f' for float, 'i' for integer)
+    void* data;              // First element, views point into another array's data
+    uint64_t* dimensions;    // Array shape
+    uint64_t* strides;       // Bytes between elements along each axis
+    uint32_t nd;             // Number of dimensions
+    char dtype;              // Data type ('d' for double, 'f' for float, 'i' for integer)
+    ndarray_owner owner;     // Who releases data
+    void* mapping;           // Start of the file mapping data lies in, NDARRAY_OWNER_MMAP only
+    uint64_t mapping_size;   // Bytes mapped
+    void (*release)(void*);  // Deleter of adopted data, NDARRAY_OWNER_USER only
 } ndarray_t;
 
 ndarray_t* ndarray_create(uint64_t* dimensions, uint32_t nd, char dtype);
 void ndarray_free(ndarray_t* array);
 
+// Wrap memory the caller already holds, no copy. strides are in bytes, NULL means C order.
+// With release NULL the buffer is borrowed and must outlive the array, otherwise the array
+// adopts it and ndarray_free calls release(data)
+ndarray_t* ndarray_from_buffer(void* data, uint32_t nd, const uint64_t* dimensions, const uint64_t* strides, char dtype,
+                               void (*release)(void*));
+
+// Comma-separated numbers, shape inferred from the file, a non-numeric first line is a header
 ndarray_t* ndarray_from_csv(const char* filename, char dtype);
 
+// NumPy .npy files: little-endian '<f8', '<f4' and '<i8'/'<u8' (dtype 'i') in C order.
+// ndarray_load maps the file copy-on-write and points data into the mapping, nothing is
+// read up front and changes stay in memory. both return NULL or -1 on failure
+int ndarray_save(const ndarray_t* array, const char* filename);
+ndarray_t* ndarray_load(const char* filename);
+
 ndarray_t* ndarray_random_noise(uint64_t n_samples, uint64_t n_features, double mean, double noise_std, char dtype);
 ndarray_t* ndarray_random_normal(uint64_t n_samples, uint64_t n_features, double mean, double std, char dtype);
 
@@ -57,17 +82,28 @@ const uint64_t* ndarray_shape(const ndarray_t* array);
 char ndarray_dtype(const ndarray_t* array);
 uint64_t ndarray_size(const ndarray_t* array);
 
-// Arithmetic operations
+// Arithmetic operations, on contiguous arrays
 ndarray_t* ndarray_add(ndarray_t* result, const ndarray_t* a, const ndarray_t* b);
 ndarray_t* ndarray_subtract(ndarray_t* result, const ndarray_t* a, const ndarray_t* b);
-ndarray_t* ndarray_dot(ndarray_t* result, const ndarray_t* a, const ndarray_t* b);
 ndarray_t* ndarray_broadcast_add(ndarray_t* result, const ndarray_t* a, const ndarray_t* b);
 
+// Matrix product (m, k) x (k, n) -> (m, n) of 'd' or 'f' arrays, views included. Tiled with
+// SIMD kernels picked at runtime. Large products are spread over one pool of all cores,
+// created on first use and shared by every call, a call finding it busy runs alone
+ndarray_t* ndarray_dot(ndarray_t* result, const ndarray_t* a, const ndarray_t* b);
+
 // Comparison
 ndarray_t* ndarray_compare(ndarray_t* result, const ndarray_t* a, const ndarray_t* b, char op);
 
-// Transformations
+// Views share data with array and must not outlive it, ndarray_free releases only the view.
+// ndarray_slice keeps every step-th index in [start, stop) of one axis and ndarray_transpose
+// reverses the axes, both in O(1). ndarray_copy makes a contiguous C-order copy of any array
+ndarray_t* ndarray_slice(const ndarray_t* array, uint32_t axis, uint64_t start, uint64_t stop, uint64_t step);
 ndarray_t* ndarray_transpose(const ndarray_t* array);
+ndarray_t* ndarray_copy(const ndarray_t* array);
+int ndarray_is_contiguous(const ndarray_t* array);
+
+// Transformations
 ndarray_t* ndarray_subsample(const ndarray_t* array, uint64_t n_samples);
 
 // Concatenation
@@ -0,0 +1,52 @@
+/*
+A simple, persistent C thread pool for fork-join style parallel work.
+
+The MIT License (MIT)
+
+Copyright (c) 2025 AndY
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+
+typedef struct thread_pool thread_pool;
+
+// Work run by every worker of a pool, worker is in [0, thread_pool_size(pool))
+typedef void (*thread_pool_fn)(void* arg, int worker);
+
+// The calling thread of thread_pool_run acts as worker 0, so num_threads - 1
+// threads are started. num_threads < 1 is treated as 1.
+thread_pool* thread_pool_create(int num_threads);
+void thread_pool_free(thread_pool* pool);
+
+int thread_pool_size(const thread_pool* pool);
+
+// Run fn(arg, worker) once on every worker and wait for all of them.
+// Calls from several threads are serialized, fn must not call back into the pool.
+void thread_pool_run(thread_pool* pool, thread_pool_fn fn, void* arg);
+
+// Like thread_pool_run, but returns -1 without running anything if the pool is busy
+int thread_pool_try_run(thread_pool* pool, thread_pool_fn fn, void* arg);
+
+#endif  // THREAD_POOL_H
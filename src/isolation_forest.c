@@ -28,262 +28,3450 @@ THE SOFTWARE.
 
 #include "isolation_forest.h"
 
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #include "ndarray.h"
+#include "thread_pool.h"
 
 struct itree_node {
     int split_feature;         // Index of feature used for splitting
+    int sample_size;           // Number of samples in node
     double split_value;        // Threshold value for splitting
     struct itree_node* left;   // Left subtree
     struct itree_node* right;  // Right subtree
-    int sample_size;           // Number of samples in node
 };
 
+// Chunk of nodes handed out by a node_arena
+typedef struct node_chunk {
+    struct node_chunk* next;
+    size_t used;
+    size_t capacity;
+    itree_node nodes[];
+} node_chunk;
+
+// Bump allocator for training nodes, one per worker so no locking is needed.
+// Nodes only live until the trees are flattened, then all chunks go at once.
+typedef struct {
+    node_chunk* head;    // Chunk being filled, older chunks follow
+    size_t chunk_nodes;  // Nodes per new chunk
+} node_arena;
+
+// Flattened forest used for inference. Every tree is stored breadth-first in its own
+// slice of the node arrays, siblings are adjacent so only the left child index is kept.
+typedef struct {
+    int num_trees;                 // Number of trees
+    int num_nodes;                 // Total nodes over all trees
+    int num_features;              // Row width the model was trained on
+    char dtype;                    // Threshold type, 'd' or 'f', same as the training data
+    int32_t* tree_offset;          // First node of each tree, num_trees + 1 entries
+    int32_t* split_feature;        // Split feature per node, -1 for leaves
+    void* split_value;             // Split threshold per node, double or float by dtype. Leaves hold
+                                   // their path length instead, depth + c(sample_size)
+    int32_t* left_child;           // Tree-relative index of the left child, right child is next to it
+    int32_t* sample_size;          // Number of training samples in node
+    int ext_k;                     // Nonzeros per hyperplane normal, 0 for axis-parallel splits
+    int32_t* normal_feature;       // ext_k feature indices per node, zero for leaves
+    void* normal_weight;           // ext_k weights per node, same type as split_value
+    void* buffer;                  // Single allocation backing all arrays, NULL when mapped
+    void* mapping;                 // File mapping backing all arrays, see iforest_load_mmap
+    size_t mapping_size;           // Length of mapping
+    double threshold;              // Score above which rows are anomalies, fitted by contamination
+    double path_scale;             // Sum of c(subsample size) over trees, normalizes the total path
+    int qwidth;                    // Bytes per feature id and bin code of a quantized model, 0 otherwise
+    int num_edges;                 // Bin edges over all features, quantized models only
+    int32_t* bin_offset;           // First edge of each feature, num_features + 1 entries
+    double* bin_edges;             // Ascending edges per feature, a value's bin is the count of edges <= it
+    void* qfeature;                // Split feature per node, QUANT_LEAF for leaves
+    void* qcode;                   // Bin code per node, rows whose bin is below it go left
+    uint16_t* qchild;              // Left child per node, leaves hold their path length in leaf_scale units
+    double leaf_scale;             // Path length of one qchild unit at a leaf
+    _Atomic(double*) path_bounds;  // Path length bounds for iforest_predict, built on first use
+} iforest_model;
+
+// Sliding window of recent rows fed by iforest_partial_fit, and the background
+// thread that rebuilds the oldest trees from it. Fields are guarded by lock.
+typedef struct {
+    isolation_forest* forest;  // Forest the updater publishes to
+    void* rows;                // Ring buffer of capacity rows
+    uint64_t capacity;         // Window size in rows
+    uint64_t count;            // Rows held, at most capacity
+    uint64_t head;             // Slot the next row is written to
+    char dtype;                // Row dtype, the trained model's or the first batch's
+    int n_features;            // Row width
+    int next_tree;             // Oldest tree, replaced next
+    uint64_t generation;       // Updates applied so far, mixed into the tree seeds
+    int pending;               // Batches appended but not applied yet
+    int busy;                  // Updater is rebuilding trees
+    int stop;                  // Set by iforest_free
+    pthread_t thread;          // Updater
+    pthread_mutex_t lock;
+    pthread_cond_t wake;       // New batch or stop, for the updater
+    pthread_cond_t idle;       // Update finished, for iforest_flush
+} iforest_stream;
+
+// Readers of one slot counted by epoch parity, on a cache line of their own
+#define READER_SLOTS 64
+
+typedef struct {
+    _Alignas(64) atomic_long active[2];
+} reader_slot;
+
 struct isolation_forest {
-    itree_node** trees;  // Array of tree pointers
-    int num_trees;       // Total number of trees
-    int num_samples;     // Subsampling size per tree
-    int max_depth;       // Maximum tree depth
-    int num_threads;     // Number of parallel threads
-    int num_features;    // Feature dimension
+    itree_node** trees;               // Array of tree pointers, only used while training
+    _Atomic(iforest_model*) model;    // Flattened trees for inference, replaced as a whole
+    atomic_uint epoch;                // Bumped by every model replacement
+    reader_slot* slots;               // Scoring calls holding a model snapshot, see model_acquire
+    pthread_mutex_t publish_lock;     // Serializes model replacement
+    int num_trees;                    // Total number of trees
+    int num_samples;                  // Subsampling size per tree
+    double* path_table;               // c(n) for n in [0, num_samples], see average_path_length
+    int max_depth;                    // Maximum tree depth
+    int num_threads;                  // Number of parallel threads
+    thread_pool* pool;                // Workers shared by training and batch scoring
+    int num_features;                 // Feature dimension
     double contamination;
     uint32_t random_state;
+    int extension_level;              // Extended Isolation Forest level, 0 for axis-parallel splits
+    int histogram_bins;               // Bins per feature for histogram training, 0 splits on exact values
+    int subtree_workers;              // Workers that ran subtree tasks in the last training
+    uint64_t window_size;             // Rows kept for incremental training
+    int trees_per_batch;              // Trees replaced per iforest_partial_fit batch
+    _Atomic(iforest_stream*) stream;  // Incremental training state, NULL until first used
 };
 
+// Total path lengths around a score threshold, see predict_cutoff
+typedef struct {
+    double threshold;  // Score threshold labeled against
+    double low;        // Totals below are anomalies
+    double high;       // Totals above are normal
+} path_cutoff;
+
+// Batch scoring job, workers claim blocks of rows from next_row. With labels set
+// rows are labeled against cutoff instead, see iforest_predict_batch.
 typedef struct {
+    isolation_forest* forest;
+    const iforest_model* model;  // Snapshot every block is scored against
+    const ndarray_t* data;
+    double* out;
+    int* labels;
+    const double* bounds;  // Path bounds of model, labeling only
+    path_cutoff cutoff;    // Labeling only
+    atomic_uint_fast64_t next_row;
+} score_ctx;
+
+// xoshiro256** state, one per tree so results do not depend on thread scheduling
+typedef struct {
+    uint64_t s[4];
+} iforest_rng;
+
+typedef struct build_ctx build_ctx;
+typedef struct train_histogram train_histogram;
+
+// Per-tree training state, shared by the tree's root build and its subtree tasks
+typedef struct {
+    build_ctx* ctx;               // Scheduler to hand subtree tasks to, NULL builds everything inline
+    void** rows;                  // Subsample row pointers, in sampled order
+    char dtype;                   // Row dtype, 'd' or 'f'
+    int n_features;               // Row width
+    int max_depth;                // Depth limit
+    int ext_k;                    // Nonzeros per hyperplane normal, 0 for axis-parallel splits
+    double* values;               // Node feature or projection at each index slot, exact splits only
+    const double* path_table;     // c(n) by leaf size, the forest's path_table
+    const train_histogram* hist;  // Binned training set, NULL to split on the rows' values
+    int32_t* index;               // Subsample row of each slot, partitioned in place. Positions in
+                                  // rows, or training set rows with hist
+    atomic_int refs;              // Root build plus outstanding subtree tasks, last one frees the buffers
+} tree_job;
+
+// Right subtree of a large node, built by whichever worker picks it up
+typedef struct subtree_task {
+    tree_job* job;
+    itree_node** slot;  // Where the built subtree is stored
+    iforest_rng rng;    // Stream forked from the parent, independent of the builder thread
+    int start;
+    int end;
+    int depth;
+    struct subtree_task* next;
+} subtree_task;
+
+// Work shared by the training threads: trees are claimed from a counter,
+// subtrees split off large trees go on a LIFO, both guarded by lock
+struct build_ctx {
     isolation_forest* forest;
     ndarray_t* data;
-    int start_tree;
-    int end_tree;
-} thread_param;
+    node_arena* arenas;     // Node allocator of each pool worker
+    int ext_k;              // Nonzeros per hyperplane normal, 0 for axis-parallel splits
+    train_histogram* hist;  // Binned data for histogram training, NULL otherwise
+    int next_tree;          // Next tree index to hand out
+    subtree_task* tasks;    // Spawned subtrees waiting for a worker
+    int pending;            // Claimed trees and spawned subtrees not finished yet
+    int subtree_workers;    // Workers that ran at least one subtree task
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Upper bound on a single arena chunk, 2MB of nodes
+#define ARENA_MAX_CHUNK_NODES ((size_t)1 << 16)
+
+// Nodes with at least this many rows hand their right subtree to another worker
+#define SUBTREE_TASK_ROWS 8192
+
+// Rows claimed per scoring step, small batches are scored inline on the caller
+#define SCORE_BLOCK_ROWS 1024
 
-// Recursively create tree node
-static itree_node* create_node(double** data, int n_features, int start, int end, int depth, int max_depth)
+// Rows traversed together by the batch scoring kernel
+#define SCORE_TILE 32
+
+static inline uint64_t rotl64(uint64_t x, int k)
 {
-    // int seed         = 42;
-    itree_node* node = malloc(sizeof(itree_node));
-    if (node == NULL) {
-        return NULL;
+    return (x << k) | (x >> (64 - k));
+}
+
+// Seed with splitmix64 so nearby seeds give unrelated streams
+static void rng_seed(iforest_rng* rng, uint64_t seed)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z          = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z          = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        rng->s[i]  = z ^ (z >> 31);
     }
-    node->left = node->right = NULL;
+}
 
-    // Termination conditions
-    if (depth >= max_depth || end - start <= 1) {
-        node->split_feature = -1;
-        node->sample_size   = end - start;
-        return node;
+static inline uint64_t rng_next(iforest_rng* rng)
+{
+    uint64_t* s     = rng->s;
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t      = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return result;
+}
+
+// Uniform double in [0, 1)
+static inline double rng_uniform(iforest_rng* rng)
+{
+    return (rng_next(rng) >> 11) * 0x1.0p-53;
+}
+
+// Uniform integer in [0, n), multiply-shift without modulo bias worth caring about
+static inline uint64_t rng_bounded(iforest_rng* rng, uint64_t n)
+{
+    return (uint64_t)(((unsigned __int128)rng_next(rng) * n) >> 64);
+}
+
+// Average path length of an unsuccessful search in a binary search tree of n
+// points, c(n) in the paper. Same definition as scikit-learn, c(2) = 1.
+static double average_path_length(int n)
+{
+    if (n <= 1) {
+        return 0.0;
+    }
+    if (n == 2) {
+        return 1.0;
     }
+    return 2.0 * (log(n - 1.0) + 0.57721566490153286) - 2.0 * (n - 1.0) / n;
+}
 
-    // Random feature selection
-    // int feat_idx = rand_r(&seed) % n_features;
-    int feat_idx = rand() % n_features;
-    double min   = data[start][feat_idx];
-    double max   = min;
+// Gather a feature of the rows at index slots [start, end) into one contiguous run of
+// job->values, with its min and max. Each node reads its rows once, the range scan and
+// partition then stream through the run.
+static void gather_feature(tree_job* job, int feat_idx, int start, int end, double* min, double* max)
+{
+    void** rows          = job->rows;
+    const int32_t* index = job->index;
+    double* values       = job->values;
+    if (job->dtype == 'f') {
+        for (int i = start; i < end; i++) {
+            values[i] = ((float*)rows[index[i]])[feat_idx];
+        }
+    } else {
+        for (int i = start; i < end; i++) {
+            values[i] = ((double*)rows[index[i]])[feat_idx];
+        }
+    }
 
-    // Calculate feature range
+    double lo = values[start];
+    double hi = lo;
     for (int i = start + 1; i < end; i++) {
-        double val = data[i][feat_idx];
-        if (val < min) min = val;
-        if (val > max) max = val;
+        lo = (values[i] < lo) ? values[i] : lo;
+        hi = (values[i] > hi) ? values[i] : hi;
     }
+    *min = lo;
+    *max = hi;
+}
 
-    // Generate split value and partition data
-    // double split_val = min + (max - min) * (rand_r(&seed) / (double)RAND_MAX);
-    double split_val = min + (max - min) * (rand() / (double)RAND_MAX);
-    int pivot        = start;
+// Move slots with a value below split_val to the front, index and values together.
+// Float values are exact in double, so float rows compare the same as in scoring.
+static int partition_values(tree_job* job, int start, int end, double split_val)
+{
+    int32_t* index = job->index;
+    double* values = job->values;
+    int pivot      = start;
     for (int i = start; i < end; i++) {
-        if (data[i][feat_idx] < split_val) {
-            double* tmp = data[pivot];
-            data[pivot] = data[i];
-            data[i]     = tmp;
+        if (values[i] < split_val) {
+            int32_t row   = index[pivot];
+            double value  = values[pivot];
+            index[pivot]  = index[i];
+            values[pivot] = values[i];
+            index[i]      = row;
+            values[i]     = value;
             pivot++;
         }
     }
+    return pivot;
+}
 
-    // Build subtrees recursively
-    node->split_feature = feat_idx;
-    node->split_value   = split_val;
-    node->sample_size   = end - start;
-    node->left          = create_node(data, n_features, start, pivot, depth + 1, max_depth);
-    node->right         = create_node(data, n_features, pivot, end, depth + 1, max_depth);
-    return node;
+// Training set binned once for histogram training: every feature is cut into num_bins
+// equal-width bins over its range, bin b being [edges[b], edges[b + 1]). Nodes scan
+// and partition 1-byte codes by row index, splits fall on interior edges.
+struct train_histogram {
+    int num_bins;   // Bins per feature, at most 256
+    uint64_t rows;  // Rows of the training set
+    double* edges;  // num_bins + 1 edges per feature, in the data dtype's precision
+    uint8_t* code;  // Bin of every row per feature, rows codes per feature
+};
+
+static void train_histogram_free(train_histogram* hist)
+{
+    if (hist) {
+        free(hist->edges);
+        free(hist->code);
+        free(hist);
+    }
 }
 
-// Calculate path length to isolate data point
-static int itree_get_path_len(itree_node* node, double* x)
+// Bin every feature of data, NaN goes to the last bin like in the comparisons x < edge
+static train_histogram* train_histogram_build(const ndarray_t* data, int num_bins)
 {
-    int len             = 0;
-    itree_node* current = node;
-    while (current != NULL && current->split_feature != -1) {
-        if (x[current->split_feature] < current->split_value) {
-            current = current->left;
-        } else {
-            current = current->right;
+    uint64_t rows         = data->dimensions[0];
+    int n_features        = (int)data->dimensions[1];
+    train_histogram* hist = malloc(sizeof(train_histogram));
+    if (hist == NULL) {
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    hist->num_bins = num_bins;
+    hist->rows     = rows;
+    hist->edges    = malloc((size_t)n_features * (num_bins + 1) * sizeof(double));
+    hist->code     = malloc(rows * n_features);
+    if (hist->edges == NULL || hist->code == NULL) {
+        printf("Memory allocation failed.\n");
+        train_histogram_free(hist);
+        return NULL;
+    }
+
+    // Feature ranges in one pass over the rows, kept in the outer edges
+    for (int j = 0; j < n_features; j++) {
+        hist->edges[(size_t)j * (num_bins + 1)]            = INFINITY;
+        hist->edges[(size_t)j * (num_bins + 1) + num_bins] = -INFINITY;
+    }
+    for (uint64_t i = 0; i < rows; i++) {
+        const uint8_t* row = (const uint8_t*)data->data + i * data->strides[0];
+        for (int j = 0; j < n_features; j++) {
+            double value  = (data->dtype == 'f') ? ((const float*)row)[j] : ((const double*)row)[j];
+            double* range = hist->edges + (size_t)j * (num_bins + 1);
+            if (value < range[0]) range[0] = value;
+            if (value > range[num_bins]) range[num_bins] = value;
+        }
+    }
+    for (int j = 0; j < n_features; j++) {
+        double* edges = hist->edges + (size_t)j * (num_bins + 1);
+        double min    = edges[0];
+        double max    = edges[num_bins];
+        if (min > max) min = max = 0;
+        for (int b = 0; b <= num_bins; b++) {
+            edges[b] = (b == num_bins) ? max : min + (max - min) * b / num_bins;
+            if (data->dtype == 'f') edges[b] = (float)edges[b];
+        }
+    }
+
+    // Equal widths give the bin up to rounding, the edges settle it exactly
+    for (uint64_t i = 0; i < rows; i++) {
+        const uint8_t* row = (const uint8_t*)data->data + i * data->strides[0];
+        for (int j = 0; j < n_features; j++) {
+            const double* edges = hist->edges + (size_t)j * (num_bins + 1);
+            double value        = (data->dtype == 'f') ? ((const float*)row)[j] : ((const double*)row)[j];
+            int b               = num_bins - 1;
+            if (!isnan(value) && edges[num_bins] > edges[0]) {
+                double guess = (value - edges[0]) * num_bins / (edges[num_bins] - edges[0]);
+                b            = (guess < 1) ? 0 : (guess >= num_bins - 1) ? num_bins - 1 : (int)guess;
+                while (b > 0 && value < edges[b]) b--;
+                while (b < num_bins - 1 && value >= edges[b + 1]) b++;
+            }
+            hist->code[(size_t)j * rows + i] = (uint8_t)b;
         }
-        len++;
     }
-    return len;
+    return hist;
 }
 
-static void free_tree(itree_node* node)
+// Least and greatest bin of a feature over rows [start, end) of index
+static void histogram_range(const train_histogram* hist, const int32_t* index, int feat_idx, int start, int end,
+                            int* lo, int* hi)
 {
-    if (node) {
-        free_tree(node->left);
-        free_tree(node->right);
-        free(node);
+    const uint8_t* code = hist->code + (size_t)feat_idx * hist->rows;
+    uint8_t min         = code[index[start]];
+    uint8_t max         = min;
+    for (int i = start + 1; i < end; i++) {
+        uint8_t b = code[index[i]];
+        if (b < min) min = b;
+        if (b > max) max = b;
     }
+    *lo = min;
+    *hi = max;
 }
 
-static double** ndarray_sample_without_replacement(ndarray_t* data, uint64_t* sample_size)
+// Rows in bins below split_bin go first, returns the pivot
+static int histogram_partition(const train_histogram* hist, int32_t* index, int feat_idx, int start, int end, int split_bin)
 {
-    // int seed       = 42;
-    uint64_t total = data->dimensions[0];
-    *sample_size   = (*sample_size < total) ? *sample_size : total;
-    // printf("sample_size[%llu] total[%llu].\n", *sample_size, total);
-    double** result = (double**)calloc(*sample_size, sizeof(double*));
+    const uint8_t* code = hist->code + (size_t)feat_idx * hist->rows;
+    int pivot           = start;
+    for (int i = start; i < end; i++) {
+        if (code[index[i]] < split_bin) {
+            int32_t row  = index[pivot];
+            index[pivot] = index[i];
+            index[i]     = row;
+            pivot++;
+        }
+    }
+    return pivot;
+}
 
-    if (!result) {
-        printf("Memory allocation failed.\n");
-        return NULL;
+// Extended splits keep their hyperplane in the arena slots right after the node:
+// k feature indices, then k weights in the model dtype
+static inline size_t normal_bytes(int k, char dtype)
+{
+    return ((k * sizeof(int32_t) + 7) & ~(size_t)7) + k * (dtype == 'f' ? sizeof(float) : sizeof(double));
+}
+
+static inline size_t normal_slots(int k, char dtype)
+{
+    return (normal_bytes(k, dtype) + sizeof(itree_node) - 1) / sizeof(itree_node);
+}
+
+static inline int32_t* node_normal_feature(const itree_node* node)
+{
+    return (int32_t*)(node + 1);
+}
+
+static inline void* node_normal_weight(const itree_node* node, int k)
+{
+    return (uint8_t*)(node + 1) + ((k * sizeof(int32_t) + 7) & ~(size_t)7);
+}
+
+// Projection of a row on a sparse normal. Terms are added with fma in feature
+// order, so training and every scoring kernel round exactly the same way.
+static inline double project_d(const int32_t* feature, const double* weight, int k, const double* x)
+{
+    double p = 0;
+    for (int j = 0; j < k; j++) {
+        p = fma(weight[j], x[feature[j]], p);
+    }
+    return p;
+}
+
+static inline float project_f(const int32_t* feature, const float* weight, int k, const float* x)
+{
+    float p = 0;
+    for (int j = 0; j < k; j++) {
+        p = fmaf(weight[j], x[feature[j]], p);
     }
+    return p;
+}
 
-    double** temp = (double**)calloc(total, sizeof(double*));
-    if (!temp) {
-        printf("Memory allocation failed.\n");
-        free(result);
-        return NULL;
+typedef void (*project_rows_fn)(void** rows, const int32_t* index, const int32_t* feature, const void* weight, int k, int start, int end, double* out);
+
+static void project_rows_d(void** rows, const int32_t* index, const int32_t* feature, const void* weight, int k, int start, int end, double* out)
+{
+    for (int i = start; i < end; i++) {
+        out[i] = project_d(feature, weight, k, rows[index[i]]);
     }
+}
 
-    for (uint64_t i = 0; i < total; i++) {
-        uint64_t stride = data->strides[0];
-        temp[i]         = &data->data[i * stride];
+static void project_rows_f(void** rows, const int32_t* index, const int32_t* feature, const void* weight, int k, int start, int end, double* out)
+{
+    for (int i = start; i < end; i++) {
+        out[i] = project_f(feature, weight, k, rows[index[i]]);
     }
+}
 
-    // Fisher-Yates Shuffle
-    for (uint64_t i = 0; i < *sample_size; i++) {
-        // int j = i + rand_r(&seed) % (*sample_size - i);
-        int j = i + rand() % (total - i);
-        // printf("Fisher-Yates Shuffle: [i, j] [%llu, %d]\n", i, j);
-        double* swap = temp[i];
-        temp[i]      = temp[j];
-        temp[j]      = swap;
+#if defined(__GNUC__) && defined(__x86_64__)
+// 4 slots at a time, each lane gathers straight from its row pointer
+__attribute__((target("avx2,fma"))) static void project_rows_d_avx2(void** rows, const int32_t* index, const int32_t* feature, const void* weight, int k, int start, int end, double* out)
+{
+    const double* w = weight;
+    int i           = start;
+    for (; i + 4 <= end; i += 4) {
+        __m128i slots = _mm_loadu_si128((const __m128i*)(index + i));
+        __m256i addr  = _mm256_i32gather_epi64((const long long*)rows, slots, sizeof(void*));
+        __m256d p     = _mm256_setzero_pd();
+        for (int j = 0; j < k; j++) {
+            __m256i cell = _mm256_add_epi64(addr, _mm256_set1_epi64x((int64_t)feature[j] * sizeof(double)));
+            p            = _mm256_fmadd_pd(_mm256_set1_pd(w[j]), _mm256_i64gather_pd(NULL, cell, 1), p);
+        }
+        _mm256_storeu_pd(out + i, p);
     }
+    project_rows_d(rows, index, feature, weight, k, i, end, out);
+}
 
-    for (uint64_t i = 0; i < *sample_size; i++) {
-        result[i] = temp[i];
+__attribute__((target("avx2,fma"))) static void project_rows_f_avx2(void** rows, const int32_t* index, const int32_t* feature, const void* weight, int k, int start, int end, double* out)
+{
+    const float* w = weight;
+    int i          = start;
+    for (; i + 4 <= end; i += 4) {
+        __m128i slots = _mm_loadu_si128((const __m128i*)(index + i));
+        __m256i addr  = _mm256_i32gather_epi64((const long long*)rows, slots, sizeof(void*));
+        __m128 p      = _mm_setzero_ps();
+        for (int j = 0; j < k; j++) {
+            __m256i cell = _mm256_add_epi64(addr, _mm256_set1_epi64x((int64_t)feature[j] * sizeof(float)));
+            p            = _mm_fmadd_ps(_mm_set1_ps(w[j]), _mm256_i64gather_ps(NULL, cell, 1), p);
+        }
+        _mm256_storeu_pd(out + i, _mm256_cvtps_pd(p));
     }
+    project_rows_f(rows, index, feature, weight, k, i, end, out);
+}
+#endif
 
-    free(temp);
-    return result;
+static project_rows_fn project_rows_d_impl = project_rows_d;
+static project_rows_fn project_rows_f_impl = project_rows_f;
+static pthread_once_t project_rows_once    = PTHREAD_ONCE_INIT;
+
+// Results do not depend on the choice, IFOREST_SIMD=scalar still forces the plain loops
+static void project_rows_dispatch(void)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+    const char* simd = getenv("IFOREST_SIMD");
+    __builtin_cpu_init();
+    if ((simd == NULL || strcmp(simd, "scalar") != 0) && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        project_rows_d_impl = project_rows_d_avx2;
+        project_rows_f_impl = project_rows_f_avx2;
+    }
+#endif
 }
 
-static void* build_trees_thread(void* arg)
+// Split with a random hyperplane (Extended Isolation Forest): ext_k distinct features
+// with N(0, 1) weights, through a point drawn uniformly from the rows' bounding box.
+// Rows projecting below the threshold go first, returns the pivot.
+static int split_extended(tree_job* job, itree_node* node, iforest_rng* rng, int start, int end)
 {
-    thread_param* param = (thread_param*)arg;
-    uint32_t seed       = param->forest->random_state;
-    uint64_t n_samples  = param->data->dimensions[0];
-    uint64_t n_features = param->data->dimensions[1];
+    int k            = job->ext_k;
+    int32_t* feature = node_normal_feature(node);
+    void* weight     = node_normal_weight(node, k);
 
-    printf("thread[%lu] build trees. data-shape(%llu, %llu)\n", (unsigned long)pthread_self(), n_samples, n_features);
-    srand(seed);
-    for (int i = param->start_tree; i < param->end_tree; i++) {
-        // sampling with/without replacement
-        uint64_t sample_size = param->forest->num_samples;
-        double** subsample   = ndarray_sample_without_replacement(param->data, &sample_size);
-        if (subsample == NULL) {
-            printf("Memory allocation failed.\n");
+    // Floyd's sampling of k features, kept sorted for the row reads
+    for (int j = job->n_features - k, count = 0; j < job->n_features; j++, count++) {
+        int32_t pick = (int32_t)rng_bounded(rng, j + 1);
+        for (int m = 0; m < count; m++) {
+            if (feature[m] == pick) {
+                pick = j;
+                break;
+            }
+        }
+        int m = count;
+        while (m > 0 && feature[m - 1] > pick) {
+            feature[m] = feature[m - 1];
+            m--;
+        }
+        feature[m] = pick;
+    }
+
+    double threshold = 0;
+    for (int j = 0; j < k; j++) {
+        double u = 1.0 - rng_uniform(rng);
+        double w = sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * rng_uniform(rng));
+        if (job->dtype == 'f') {
+            w                   = (float)w;
+            ((float*)weight)[j] = (float)w;
+        } else {
+            ((double*)weight)[j] = w;
+        }
+        double min, max;
+        gather_feature(job, feature[j], start, end, &min, &max);
+        threshold += w * (min + (max - min) * rng_uniform(rng));
+    }
+    if (job->dtype == 'f') threshold = (float)threshold;
+
+    // Project once, then partition on the projections like on a single feature
+    (job->dtype == 'f' ? project_rows_f_impl : project_rows_d_impl)(job->rows, job->index, feature, weight, k, start, end, job->values);
+    int pivot = partition_values(job, start, end, threshold);
+
+    // Any non-negative feature marks a split, the hyperplane is read from the slots
+    node->split_feature = feature[0];
+    node->split_value   = threshold;
+    return pivot;
+}
+
+// count adjacent node slots, extended splits keep their normal in the slots after the node
+static itree_node* arena_alloc(node_arena* arena, size_t count)
+{
+    node_chunk* chunk = arena->head;
+    if (chunk == NULL || chunk->used + count > chunk->capacity) {
+        size_t capacity = (arena->chunk_nodes > count) ? arena->chunk_nodes : count;
+        chunk           = malloc(sizeof(node_chunk) + capacity * sizeof(itree_node));
+        if (chunk == NULL) {
             return NULL;
         }
+        chunk->next     = arena->head;
+        chunk->used     = 0;
+        chunk->capacity = capacity;
+        arena->head     = chunk;
+    }
+    chunk->used += count;
+    return &chunk->nodes[chunk->used - count];
+}
 
-        param->forest->trees[i] = create_node(subsample, n_features, 0,
-                                              param->forest->num_samples, 0,
-                                              param->forest->max_depth);
-        free(subsample);
+static void arena_free(node_arena* arena)
+{
+    while (arena->head) {
+        node_chunk* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
     }
-    return NULL;
 }
 
-// static void* build_trees_thread(void* arg)
-// {
-//     thread_param* param = (thread_param*)arg;
-//     for (int i = param->start_tree; i < param->end_tree; i++) {
-//         data_point* subsample = malloc(param->forest->subsample_size * sizeof(data_point));
-//         CHECK_PTR(subsample);
+static void tree_job_release(tree_job* job)
+{
+    if (atomic_fetch_sub(&job->refs, 1) == 1) {
+        free(job->rows);
+        free(job->values);
+        free(job->index);
+        free(job);
+    }
+}
 
-//         for (int j = 0; j < param->forest->subsample_size; j++) {
-//             int idx      = rand() % param->forest->data_size;
-//             subsample[j] = param->data[idx];
-//         }
+static itree_node* create_node(tree_job* job, node_arena* arena, iforest_rng* rng, int start, int end, int depth);
 
-//         param->forest->trees[i] = create_node(subsample, 0,
-//                                               param->forest->subsample_size, 0,
-//                                               param->forest->max_depth);
-//         free(subsample);
-//     }
-//     return NULL;
-// }
+// Hand the right subtree to the scheduler, returns 0 if the caller has to build it
+static int spawn_subtree(tree_job* job, itree_node** slot, const iforest_rng* rng, int start, int end, int depth)
+{
+    build_ctx* ctx     = job->ctx;
+    subtree_task* task = malloc(sizeof(subtree_task));
+    if (task == NULL) {
+        return 0;
+    }
+    task->job   = job;
+    task->slot  = slot;
+    task->rng   = *rng;
+    task->start = start;
+    task->end   = end;
+    task->depth = depth;
+    atomic_fetch_add(&job->refs, 1);
 
-isolation_forest* iforest_init(int num_trees, int num_samples, int num_features,
-                               int num_threads, double contamination, uint32_t random_state)
+    pthread_mutex_lock(&ctx->lock);
+    task->next = ctx->tasks;
+    ctx->tasks = task;
+    ctx->pending++;
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    return 1;
+}
+
+// Recursively create tree node over index slots [start, end) of job.
+// Nodes come from the arena of the worker running the call.
+static itree_node* create_node(tree_job* job, node_arena* arena, iforest_rng* rng, int start, int end, int depth)
 {
-    isolation_forest* forest = calloc(1, sizeof(isolation_forest));
-    if (forest == NULL) {
+    // Termination conditions
+    int leaf         = depth >= job->max_depth || end - start <= 1;
+    itree_node* node = arena_alloc(arena, (leaf || !job->ext_k) ? 1 : 1 + normal_slots(job->ext_k, job->dtype));
+    if (node == NULL) {
         return NULL;
     }
+    node->left        = node->right = NULL;
+    node->sample_size = end - start;
+    if (leaf) {
+        // Unsplit rows add the expected path length of a tree over them
+        node->split_feature = -1;
+        node->split_value   = depth + job->path_table[end - start];
+        return node;
+    }
 
-    forest->num_trees     = num_trees;
-    forest->num_samples   = num_samples;
-    forest->max_depth     = (int)(ceil(log2(num_samples > 2 ? num_samples : 2))) + 2;
-    forest->num_threads   = num_threads;
-    forest->num_features  = num_features;
-    forest->contamination = contamination;
-    forest->random_state  = random_state;
+    int pivot;
+    if (job->ext_k) {
+        pivot = split_extended(job, node, rng, start, end);
+    } else if (job->hist) {
+        // Same draw over the span of the node's bins, then the cut moves to the nearest
+        // interior edge. A node within one bin keeps every row on the right.
+        int feat_idx = (int)rng_bounded(rng, job->n_features);
+        int lo, hi;
+        histogram_range(job->hist, job->index, feat_idx, start, end, &lo, &hi);
+        const double* edges = job->hist->edges + (size_t)feat_idx * (job->hist->num_bins + 1);
+        double split_val    = edges[lo] + (edges[hi + 1] - edges[lo]) * rng_uniform(rng);
+        int split_bin       = lo;
+        if (hi > lo) {
+            split_bin = lo + 1;
+            while (split_bin < hi && edges[split_bin + 1] <= split_val) split_bin++;
+            if (split_bin < hi && split_val - edges[split_bin] > edges[split_bin + 1] - split_val) split_bin++;
+        }
+        pivot = histogram_partition(job->hist, job->index, feat_idx, start, end, split_bin);
 
-    forest->trees = malloc(num_trees * sizeof(itree_node*));
-    if (forest->trees == NULL) {
-        forest->num_trees = 0;
+        node->split_feature = feat_idx;
+        node->split_value   = edges[split_bin];
+    } else {
+        // Random feature selection
+        int feat_idx = (int)rng_bounded(rng, job->n_features);
+        double min, max;
+        gather_feature(job, feat_idx, start, end, &min, &max);
+
+        // Generate split value and partition data. Float thresholds are rounded
+        // before partitioning so training and scoring compare the same value.
+        double split_val = min + (max - min) * rng_uniform(rng);
+        if (job->dtype == 'f') split_val = (float)split_val;
+        pivot = partition_values(job, start, end, split_val);
+
+        node->split_feature = feat_idx;
+        node->split_value   = split_val;
     }
 
-    return forest;
+    // Large nodes fork a stream for the right subtree whether or not it runs as a
+    // task, so the tree does not depend on which thread builds which part
+    if (end - start >= SUBTREE_TASK_ROWS) {
+        iforest_rng right_rng;
+        rng_seed(&right_rng, rng_next(rng));
+        int spawned = job->ctx && spawn_subtree(job, &node->right, &right_rng, pivot, end, depth + 1);
+        node->left  = create_node(job, arena, rng, start, pivot, depth + 1);
+        if (!spawned) {
+            node->right = create_node(job, arena, &right_rng, pivot, end, depth + 1);
+        }
+        return node;
+    }
+
+    // Build subtrees recursively
+    node->left  = create_node(job, arena, rng, start, pivot, depth + 1);
+    node->right = create_node(job, arena, rng, pivot, end, depth + 1);
+    return node;
 }
 
-void iforest_train(isolation_forest* forest, ndarray_t* data)
+// Path length in an extended model, the node's projection stands in for the feature value
+static double itree_get_path_len_ext_d(const iforest_model* model, int tree, const double* x)
 {
-    int num_threads = (forest->num_threads > 0) ? ((forest->num_threads < forest->num_trees) ? forest->num_threads : forest->num_trees) : 1;
-    pthread_t threads[num_threads];
-    thread_param params[num_threads];
-    int trees_per_thread = forest->num_trees / num_threads;
+    int k                         = model->ext_k;
+    int32_t offset                = model->tree_offset[tree];
+    const int32_t* split_feature  = model->split_feature + offset;
+    const double* split_value     = (const double*)model->split_value + offset;
+    const int32_t* left_child     = model->left_child + offset;
+    const int32_t* normal_feature = model->normal_feature + (size_t)offset * k;
+    const double* normal_weight   = (const double*)model->normal_weight + (size_t)offset * k;
 
-    for (int i = 0; i < num_threads; i++) {
-        params[i].forest     = forest;
-        params[i].data       = data;
-        params[i].start_tree = i * trees_per_thread;
-        params[i].end_tree   = (i == num_threads - 1) ? forest->num_trees : (i + 1) * trees_per_thread;
-        pthread_create(&threads[i], NULL, build_trees_thread, &params[i]);
+    int idx = 0;
+    while (split_feature[idx] != -1) {
+        double p = project_d(normal_feature + idx * k, normal_weight + idx * k, k, x);
+        idx      = left_child[idx] + !(p < split_value[idx]);
     }
+    return split_value[idx];
+}
+
+static double itree_get_path_len_ext_f(const iforest_model* model, int tree, const float* x)
+{
+    int k                         = model->ext_k;
+    int32_t offset                = model->tree_offset[tree];
+    const int32_t* split_feature  = model->split_feature + offset;
+    const float* split_value      = (const float*)model->split_value + offset;
+    const int32_t* left_child     = model->left_child + offset;
+    const int32_t* normal_feature = model->normal_feature + (size_t)offset * k;
+    const float* normal_weight    = (const float*)model->normal_weight + (size_t)offset * k;
 
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
+    int idx = 0;
+    while (split_feature[idx] != -1) {
+        float p = project_f(normal_feature + idx * k, normal_weight + idx * k, k, x);
+        idx     = left_child[idx] + !(p < split_value[idx]);
     }
+    return split_value[idx];
 }
 
-double iforest_score(isolation_forest* forest, double* x)
+// Path length to isolate data point, the depth of its leaf plus the leaf's correction. Double model
+static double itree_get_path_len_d(const iforest_model* model, int tree, const double* x)
+{
+    if (model->ext_k) {
+        return itree_get_path_len_ext_d(model, tree, x);
+    }
+
+    int32_t offset               = model->tree_offset[tree];
+    const int32_t* split_feature = model->split_feature + offset;
+    const double* split_value    = (const double*)model->split_value + offset;
+    const int32_t* left_child    = model->left_child + offset;
+
+    int idx = 0;
+    while (split_feature[idx] != -1) {
+        idx = left_child[idx] + !(x[split_feature[idx]] < split_value[idx]);
+    }
+    return split_value[idx];
+}
+
+// Calculate path length to isolate data point, float model
+static double itree_get_path_len_f(const iforest_model* model, int tree, const float* x)
+{
+    if (model->ext_k) {
+        return itree_get_path_len_ext_f(model, tree, x);
+    }
+
+    int32_t offset               = model->tree_offset[tree];
+    const int32_t* split_feature = model->split_feature + offset;
+    const float* split_value     = (const float*)model->split_value + offset;
+    const int32_t* left_child    = model->left_child + offset;
+
+    int idx = 0;
+    while (split_feature[idx] != -1) {
+        idx = left_child[idx] + !(x[split_feature[idx]] < split_value[idx]);
+    }
+    return split_value[idx];
+}
+
+// Path length of a row in the other dtype, for single-point calls. Each value is
+// converted where it is read, which compares exactly like converting the row first.
+// Float model, double row
+static double itree_get_path_len_fd(const iforest_model* model, int tree, const double* x)
+{
+    int k                         = model->ext_k;
+    int32_t offset                = model->tree_offset[tree];
+    const int32_t* split_feature  = model->split_feature + offset;
+    const float* split_value      = (const float*)model->split_value + offset;
+    const int32_t* left_child     = model->left_child + offset;
+    const int32_t* normal_feature = k ? model->normal_feature + (size_t)offset * k : NULL;
+    const float* normal_weight    = k ? (const float*)model->normal_weight + (size_t)offset * k : NULL;
+
+    int idx = 0;
+    while (split_feature[idx] != -1) {
+        float value = 0;
+        if (k) {
+            for (int j = 0; j < k; j++) {
+                value = fmaf(normal_weight[idx * k + j], (float)x[normal_feature[idx * k + j]], value);
+            }
+        } else {
+            value = (float)x[split_feature[idx]];
+        }
+        idx = left_child[idx] + !(value < split_value[idx]);
+    }
+    return split_value[idx];
+}
+
+// Double model, float row
+static double itree_get_path_len_df(const iforest_model* model, int tree, const float* x)
+{
+    int k                         = model->ext_k;
+    int32_t offset                = model->tree_offset[tree];
+    const int32_t* split_feature  = model->split_feature + offset;
+    const double* split_value     = (const double*)model->split_value + offset;
+    const int32_t* left_child     = model->left_child + offset;
+    const int32_t* normal_feature = k ? model->normal_feature + (size_t)offset * k : NULL;
+    const double* normal_weight   = k ? (const double*)model->normal_weight + (size_t)offset * k : NULL;
+
+    int idx = 0;
+    while (split_feature[idx] != -1) {
+        double value = 0;
+        if (k) {
+            for (int j = 0; j < k; j++) {
+                value = fma(normal_weight[idx * k + j], x[normal_feature[idx * k + j]], value);
+            }
+        } else {
+            value = x[split_feature[idx]];
+        }
+        idx = left_child[idx] + !(value < split_value[idx]);
+    }
+    return split_value[idx];
+}
+
+// Feature id marking a leaf in a quantized model of the given width
+#define QUANT_LEAF(width) ((width) == 1 ? 0xFF : 0xFFFF)
+
+static inline int32_t quant_load(const void* array, int width, size_t i)
+{
+    return (width == 1) ? ((const uint8_t*)array)[i] : ((const uint16_t*)array)[i];
+}
+
+static inline void quant_store(void* array, int width, size_t i, int32_t value)
+{
+    if (width == 1) {
+        ((uint8_t*)array)[i] = (uint8_t)value;
+    } else {
+        ((uint16_t*)array)[i] = (uint16_t)value;
+    }
+}
+
+// Bin of value for feature j, the count of the feature's edges <= value. The value is
+// first rounded to the model dtype like the full model compares it, NaN takes the last
+// bin so it goes right at every split as it does in the full model.
+static uint16_t quant_bin(const iforest_model* model, int j, double value)
+{
+    if (model->dtype == 'f') value = (float)value;
+    const double* edges = model->bin_edges + model->bin_offset[j];
+    int lo              = 0;
+    int hi              = model->bin_offset[j + 1] - model->bin_offset[j];
+    if (isnan(value)) {
+        return (uint16_t)hi;
+    }
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (edges[mid] <= value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (uint16_t)lo;
+}
+
+// Bin every feature of a row of dtype 'd' or 'f'
+static void quant_bin_row(const iforest_model* model, const void* x, char dtype, uint16_t* bins)
 {
-    double avg_path = 0.0;
-    for (int i = 0; i < forest->num_trees; i++) {
-        int len = itree_get_path_len(forest->trees[i], x);
-        avg_path += len;
-        // printf("[%d] path len[%d] total-len[%.1f]\n", i, len, avg_path);
+    for (int j = 0; j < model->num_features; j++) {
+        double value = (dtype == 'f') ? ((const float*)x)[j] : ((const double*)x)[j];
+        bins[j]      = quant_bin(model, j, value);
+    }
+}
+
+// Path length in a quantized tree, splits compare the row's bins with the node codes
+static double itree_get_path_len_q(const iforest_model* model, int tree, const uint16_t* bins)
+{
+    int32_t offset        = model->tree_offset[tree];
+    const uint16_t* child = model->qchild + offset;
+
+    int idx = 0;
+    if (model->qwidth == 1) {
+        const uint8_t* feature = (const uint8_t*)model->qfeature + offset;
+        const uint8_t* code    = (const uint8_t*)model->qcode + offset;
+        while (feature[idx] != 0xFF) {
+            idx = child[idx] + !(bins[feature[idx]] < code[idx]);
+        }
+    } else {
+        const uint16_t* feature = (const uint16_t*)model->qfeature + offset;
+        const uint16_t* code    = (const uint16_t*)model->qcode + offset;
+        while (feature[idx] != 0xFFFF) {
+            idx = child[idx] + !(bins[feature[idx]] < code[idx]);
+        }
+    }
+    return child[idx] * model->leaf_scale;
+}
+
+// Rows up to this many features are binned on the stack by single-point calls
+#define QUANT_STACK_FEATURES 1024
+
+// Path length in a quantized tree for a row too wide to bin up front, every split bins
+// the value it reads
+static double itree_get_path_len_q_row(const iforest_model* model, int tree, const void* x, char dtype)
+{
+    int32_t offset        = model->tree_offset[tree];
+    const uint16_t* child = model->qchild + offset;
+    int width             = model->qwidth;
+
+    int idx         = 0;
+    int32_t feature = quant_load(model->qfeature, width, offset);
+    while (feature != QUANT_LEAF(width)) {
+        double value = (dtype == 'f') ? ((const float*)x)[feature] : ((const double*)x)[feature];
+        idx          = child[idx] + !(quant_bin(model, feature, value) < quant_load(model->qcode, width, offset + idx));
+        feature      = quant_load(model->qfeature, width, offset + idx);
+    }
+    return child[idx] * model->leaf_scale;
+}
+
+static int count_nodes(const itree_node* node)
+{
+    return node ? 1 + count_nodes(node->left) + count_nodes(node->right) : 0;
+}
+
+#define MODEL_ALIGN 64
+#define ALIGN_UP(n) (((n) + MODEL_ALIGN - 1) & ~(size_t)(MODEL_ALIGN - 1))
+
+// Byte offsets of the model arrays inside the model block. A quantized model
+// has only tree_offset and the bin and q* arrays, a full one has no bin arrays.
+typedef struct {
+    uint64_t split_value;
+    uint64_t tree_offset;
+    uint64_t split_feature;
+    uint64_t left_child;
+    uint64_t sample_size;
+    uint64_t normal_feature;  // Extended models only, size 0 otherwise
+    uint64_t normal_weight;
+    uint64_t bin_offset;      // Quantized models only, size 0 otherwise
+    uint64_t bin_edges;
+    uint64_t qfeature;
+    uint64_t qcode;
+    uint64_t qchild;
+    uint64_t size;            // Total block size
+} model_layout;
+
+// Layout for the counts, dtype, ext_k and qwidth of shape
+static void model_get_layout(const iforest_model* shape, model_layout* layout)
+{
+    size_t num_nodes   = shape->num_nodes;
+    size_t full_nodes  = shape->qwidth ? 0 : num_nodes;
+    size_t quant_nodes = shape->qwidth ? num_nodes : 0;
+    size_t type_size   = (shape->dtype == 'f') ? sizeof(float) : sizeof(double);
+    size_t offset_size = ALIGN_UP((shape->num_trees + 1) * sizeof(int32_t));
+    size_t int_size    = ALIGN_UP(full_nodes * sizeof(int32_t));
+    size_t value_size  = ALIGN_UP(full_nodes * type_size);
+
+    layout->split_value    = 0;
+    layout->tree_offset    = value_size;
+    layout->split_feature  = layout->tree_offset + offset_size;
+    layout->left_child     = layout->split_feature + int_size;
+    layout->sample_size    = layout->left_child + int_size;
+    layout->normal_feature = layout->sample_size + int_size;
+    layout->normal_weight  = layout->normal_feature + ALIGN_UP(full_nodes * shape->ext_k * sizeof(int32_t));
+    layout->bin_offset     = layout->normal_weight + ALIGN_UP(full_nodes * shape->ext_k * type_size);
+    layout->bin_edges      = layout->bin_offset + (shape->qwidth ? ALIGN_UP((shape->num_features + 1) * sizeof(int32_t)) : 0);
+    layout->qfeature       = layout->bin_edges + ALIGN_UP((size_t)shape->num_edges * sizeof(double));
+    layout->qcode          = layout->qfeature + ALIGN_UP(quant_nodes * shape->qwidth);
+    layout->qchild         = layout->qcode + ALIGN_UP(quant_nodes * shape->qwidth);
+    layout->size           = layout->qchild + ALIGN_UP(quant_nodes * sizeof(uint16_t));
+}
+
+// Point the model arrays into a block laid out by model_get_layout
+static void model_bind(iforest_model* model, uint8_t* block, const model_layout* layout)
+{
+    model->tree_offset = (int32_t*)(block + layout->tree_offset);
+    if (model->qwidth) {
+        model->bin_offset = (int32_t*)(block + layout->bin_offset);
+        model->bin_edges  = (double*)(block + layout->bin_edges);
+        model->qfeature   = block + layout->qfeature;
+        model->qcode      = block + layout->qcode;
+        model->qchild     = (uint16_t*)(block + layout->qchild);
+        return;
+    }
+    model->split_value   = block + layout->split_value;
+    model->split_feature = (int32_t*)(block + layout->split_feature);
+    model->left_child    = (int32_t*)(block + layout->left_child);
+    model->sample_size   = (int32_t*)(block + layout->sample_size);
+    if (model->ext_k) {
+        model->normal_feature = (int32_t*)(block + layout->normal_feature);
+        model->normal_weight  = block + layout->normal_weight;
+    }
+}
+
+// Model with the counts, dtype, ext_k and qwidth of shape, arrays left unset
+static iforest_model* model_alloc(const iforest_model* shape)
+{
+    iforest_model* model = calloc(1, sizeof(iforest_model));
+    if (model == NULL) {
+        return NULL;
+    }
+
+    // One aligned block, carved into the per-node arrays
+    model_layout layout;
+    model_get_layout(shape, &layout);
+    uint8_t* buffer = aligned_alloc(MODEL_ALIGN, layout.size);
+    if (buffer == NULL) {
+        free(model);
+        return NULL;
+    }
+
+    model->num_trees    = shape->num_trees;
+    model->num_nodes    = shape->num_nodes;
+    model->num_features = shape->num_features;
+    model->dtype        = shape->dtype;
+    model->ext_k        = shape->ext_k;
+    model->qwidth       = shape->qwidth;
+    model->num_edges    = shape->num_edges;
+    model->buffer       = buffer;
+    model_bind(model, buffer, &layout);
+    return model;
+}
+
+// c(subsample size) of every tree, the expected path length the total is measured against
+static double model_path_scale(const iforest_model* model)
+{
+    double scale = 0;
+    for (int t = 0; t < model->num_trees; t++) {
+        scale += average_path_length(model->sample_size[model->tree_offset[t]]);
+    }
+    return scale;
+}
+
+static void model_free(iforest_model* model)
+{
+    if (model) {
+        if (model->mapping) {
+            munmap(model->mapping, model->mapping_size);
+        }
+        free(atomic_load(&model->path_bounds));
+        free(model->buffer);
+        free(model);
+    }
+}
+
+// Copy a pointer tree into the model slice starting at node offset, breadth-first
+static int flatten_tree(iforest_model* model, const itree_node* root, int32_t offset, int num_nodes)
+{
+    const itree_node** queue = malloc(num_nodes * sizeof(itree_node*));
+    if (queue == NULL) {
+        return -1;
+    }
+
+    int32_t* split_feature = model->split_feature + offset;
+    int32_t* left_child    = model->left_child + offset;
+    int32_t* sample_size   = model->sample_size + offset;
+
+    // A node's index is its position in the queue
+    int head      = 0;
+    int tail      = 0;
+    queue[tail++] = root;
+    while (head < tail) {
+        const itree_node* node = queue[head];
+        split_feature[head]    = node->split_feature;
+        sample_size[head]      = node->sample_size;
+        if (model->dtype == 'f') {
+            ((float*)model->split_value)[offset + head] = (float)node->split_value;
+        } else {
+            ((double*)model->split_value)[offset + head] = node->split_value;
+        }
+        left_child[head]       = -1;
+        if (model->ext_k) {
+            // Leaves get an all-zero normal, so the SIMD kernels can read it blindly
+            int k          = model->ext_k;
+            size_t bytes   = k * ((model->dtype == 'f') ? sizeof(float) : sizeof(double));
+            int32_t* dst_f = model->normal_feature + (size_t)(offset + head) * k;
+            uint8_t* dst_w = (uint8_t*)model->normal_weight + (size_t)(offset + head) * bytes;
+            if (node->split_feature != -1) {
+                memcpy(dst_f, node_normal_feature(node), k * sizeof(int32_t));
+                memcpy(dst_w, node_normal_weight(node, k), bytes);
+            } else {
+                memset(dst_f, 0, k * sizeof(int32_t));
+                memset(dst_w, 0, bytes);
+            }
+        }
+        if (node->split_feature != -1) {
+            left_child[head] = tail;
+            queue[tail++]    = node->left;
+            queue[tail++]    = node->right;
+        }
+        head++;
+    }
+
+    free(queue);
+    return 0;
+}
+
+// Compact pointer trees into a flattened model. Trees left NULL are copied from
+// base, which must then have the same tree count, width, dtype and ext_k.
+static iforest_model* flatten_forest(const iforest_model* base, itree_node** trees, int num_trees, int num_features, char dtype, int ext_k)
+{
+    int num_nodes = 0;
+    for (int i = 0; i < num_trees; i++) {
+        num_nodes += trees[i] ? count_nodes(trees[i]) : base->tree_offset[i + 1] - base->tree_offset[i];
+    }
+
+    iforest_model shape  = {.num_trees = num_trees, .num_nodes = num_nodes, .num_features = num_features, .dtype = dtype, .ext_k = ext_k};
+    iforest_model* model = model_alloc(&shape);
+    if (model == NULL) {
+        return NULL;
+    }
+
+    size_t value_size = (dtype == 'f') ? sizeof(float) : sizeof(double);
+    int32_t offset    = 0;
+    for (int i = 0; i < num_trees; i++) {
+        model->tree_offset[i] = offset;
+        if (trees[i]) {
+            int tree_nodes = count_nodes(trees[i]);
+            if (flatten_tree(model, trees[i], offset, tree_nodes) != 0) {
+                model_free(model);
+                return NULL;
+            }
+            offset += tree_nodes;
+            continue;
+        }
+
+        // Child indices are tree-relative, so a slice moves as is
+        int32_t from       = base->tree_offset[i];
+        int32_t tree_nodes = base->tree_offset[i + 1] - from;
+        memcpy(model->split_feature + offset, base->split_feature + from, tree_nodes * sizeof(int32_t));
+        memcpy(model->left_child + offset, base->left_child + from, tree_nodes * sizeof(int32_t));
+        memcpy(model->sample_size + offset, base->sample_size + from, tree_nodes * sizeof(int32_t));
+        memcpy((uint8_t*)model->split_value + offset * value_size, (const uint8_t*)base->split_value + from * value_size,
+               tree_nodes * value_size);
+        if (ext_k) {
+            memcpy(model->normal_feature + (size_t)offset * ext_k, base->normal_feature + (size_t)from * ext_k,
+                   (size_t)tree_nodes * ext_k * sizeof(int32_t));
+            memcpy((uint8_t*)model->normal_weight + (size_t)offset * ext_k * value_size,
+                   (const uint8_t*)base->normal_weight + (size_t)from * ext_k * value_size, (size_t)tree_nodes * ext_k * value_size);
+        }
+        offset += tree_nodes;
+    }
+    model->tree_offset[num_trees] = offset;
+    model->path_scale             = model_path_scale(model);
+    return model;
+}
+
+// Model snapshots are reclaimed by epoch. A reader counts itself in its slot
+// under the parity of the current epoch, and a writer that swaps the model flips
+// the epoch and waits only for the readers counted under the old parity. Readers
+// never wait, and new readers land on the other parity so writers cannot starve.
+static _Thread_local int reader_slot_index = -1;
+static atomic_int next_reader_slot;
+
+static const iforest_model* model_acquire(isolation_forest* forest, atomic_long** pin)
+{
+    if (reader_slot_index < 0) {
+        reader_slot_index = atomic_fetch_add(&next_reader_slot, 1) % READER_SLOTS;
+    }
+    reader_slot* slot = &forest->slots[reader_slot_index];
+    for (;;) {
+        unsigned epoch       = atomic_load(&forest->epoch);
+        atomic_long* counter = &slot->active[epoch & 1];
+        atomic_fetch_add(counter, 1);
+        // A flip in between may have missed this count, go again under the new parity
+        if (atomic_load(&forest->epoch) == epoch) {
+            *pin = counter;
+            return atomic_load(&forest->model);
+        }
+        atomic_fetch_sub(counter, 1);
+    }
+}
+
+static void model_release(atomic_long* pin)
+{
+    atomic_fetch_sub(pin, 1);
+}
+
+// Make model the scoring snapshot and free the one it replaces after a grace
+// period. Caller holds publish_lock.
+static void model_publish(isolation_forest* forest, iforest_model* model)
+{
+    iforest_model* old = atomic_exchange(&forest->model, model);
+    unsigned epoch     = atomic_fetch_add(&forest->epoch, 1);
+    for (int i = 0; i < READER_SLOTS; i++) {
+        while (atomic_load(&forest->slots[i].active[epoch & 1]) != 0) {
+            sched_yield();
+        }
+    }
+    model_free(old);
+}
+
+// Pick sample_size distinct row pointers of data. A partial Fisher-Yates shuffle of
+// the row numbers, with only the slots moved so far kept in a hash table, so time and
+// memory depend on sample_size and not on the number of rows.
+static void** ndarray_sample_without_replacement(iforest_rng* rng, ndarray_t* data, uint64_t* sample_size)
+{
+    uint64_t total = data->dimensions[0];
+    *sample_size   = (*sample_size < total) ? *sample_size : total;
+    // printf("sample_size[%llu] total[%llu].\n", *sample_size, total);
+    void** result = calloc(*sample_size, sizeof(void*));
+
+    if (!result) {
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+
+    // Open addressing at most half full, an empty key is UINT64_MAX
+    int shift = 63;
+    while (((uint64_t)1 << (64 - shift)) < 2 * *sample_size) shift--;
+    uint64_t mask  = ((uint64_t)1 << (64 - shift)) - 1;
+    uint64_t* slot = malloc(2 * (mask + 1) * sizeof(uint64_t));
+    if (!slot) {
+        printf("Memory allocation failed.\n");
+        free(result);
+        return NULL;
+    }
+    memset(slot, 0xff, 2 * (mask + 1) * sizeof(uint64_t));
+
+    // Fisher-Yates Shuffle, position p holds row p until a swap moves it
+    for (uint64_t i = 0; i < *sample_size; i++) {
+        uint64_t j   = i + rng_bounded(rng, total - i);
+        uint64_t row = j;
+        uint64_t h   = (j * 0x9E3779B97F4A7C15ull) >> shift;
+        while (slot[2 * h] != UINT64_MAX && slot[2 * h] != j) h = (h + 1) & mask;
+        if (slot[2 * h] == j) row = slot[2 * h + 1];
+
+        // Slot i is never drawn again, only j needs to remember what was at i
+        uint64_t moved = i;
+        uint64_t g     = (i * 0x9E3779B97F4A7C15ull) >> shift;
+        while (slot[2 * g] != UINT64_MAX && slot[2 * g] != i) g = (g + 1) & mask;
+        if (slot[2 * g] == i) moved = slot[2 * g + 1];
+        slot[2 * h]     = j;
+        slot[2 * h + 1] = moved;
+
+        result[i] = (uint8_t*)data->data + row * data->strides[0];
+    }
+
+    free(slot);
+    return result;
+}
+
+// Sample a tree's rows and build it, large subtrees may be left to other workers
+static void build_tree(build_ctx* ctx, int tree, int worker)
+{
+    isolation_forest* forest = ctx->forest;
+
+    // Every tree draws from its own stream, so the forest is the same for any num_threads
+    iforest_rng rng;
+    rng_seed(&rng, ((uint64_t)forest->random_state << 32) | (uint32_t)tree);
+
+    tree_job* job = malloc(sizeof(tree_job));
+    if (job == NULL) {
+        printf("Memory allocation failed.\n");
+        return;
+    }
+
+    // sampling with/without replacement
+    uint64_t sample_size = forest->num_samples;
+    job->rows            = ndarray_sample_without_replacement(&rng, ctx->data, &sample_size);
+    if (job->rows == NULL) {
+        printf("Memory allocation failed.\n");
+        free(job);
+        return;
+    }
+    job->ctx        = ctx;
+    job->dtype      = ctx->data->dtype;
+    job->n_features = ctx->data->dimensions[1];
+    job->max_depth  = forest->max_depth;
+    job->ext_k      = ctx->ext_k;
+    job->values     = ctx->hist ? NULL : malloc(sample_size * sizeof(double));
+    job->path_table = forest->path_table;
+    job->hist       = ctx->hist;
+    job->index      = malloc(sample_size * sizeof(int32_t));
+    atomic_init(&job->refs, 1);
+    if ((!ctx->hist && job->values == NULL) || job->index == NULL) {
+        printf("Memory allocation failed.\n");
+        tree_job_release(job);
+        return;
+    }
+
+    // Histogram training reads codes by the sampled rows' positions in the training set
+    for (uint64_t i = 0; i < sample_size; i++) {
+        job->index[i] = ctx->hist ? (int32_t)(((uint8_t*)job->rows[i] - (uint8_t*)ctx->data->data) / ctx->data->strides[0]) : (int32_t)i;
+    }
+
+    forest->trees[tree] = create_node(job, &ctx->arenas[worker], &rng, 0, (int)sample_size, 0);
+    tree_job_release(job);
+}
+
+static void build_trees_worker(void* arg, int worker)
+{
+    build_ctx* ctx      = (build_ctx*)arg;
+    uint64_t n_samples  = ctx->data->dimensions[0];
+    uint64_t n_features = ctx->data->dimensions[1];
+
+    printf("thread[%lu] build trees. data-shape(%llu, %llu)\n", (unsigned long)pthread_self(), n_samples, n_features);
+    int subtrees_run = 0;
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        // Finish spawned subtrees first, they hold their tree's rows alive. A claimed
+        // tree counts as pending until built, its partition may still spawn subtrees.
+        subtree_task* task = ctx->tasks;
+        int tree           = -1;
+        if (task) {
+            ctx->tasks = task->next;
+        } else if (ctx->next_tree < ctx->forest->num_trees) {
+            tree = ctx->next_tree++;
+            ctx->pending++;
+        } else if (ctx->pending > 0) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+            continue;
+        } else {
+            break;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (task) {
+            *task->slot = create_node(task->job, &ctx->arenas[worker], &task->rng, task->start, task->end, task->depth);
+            tree_job_release(task->job);
+            free(task);
+            subtrees_run++;
+        } else {
+            build_tree(ctx, tree, worker);
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (--ctx->pending == 0) pthread_cond_broadcast(&ctx->cond);
+    }
+    ctx->subtree_workers += (subtrees_run > 0);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// static void* build_trees_thread(void* arg)
+// {
+//     thread_param* param = (thread_param*)arg;
+//     for (int i = param->start_tree; i < param->end_tree; i++) {
+//         data_point* subsample = malloc(param->forest->subsample_size * sizeof(data_point));
+//         CHECK_PTR(subsample);
+
+//         for (int j = 0; j < param->forest->subsample_size; j++) {
+//             int idx      = rand() % param->forest->data_size;
+//             subsample[j] = param->data[idx];
+//         }
+
+//         param->forest->trees[i] = create_node(subsample, 0,
+//                                               param->forest->subsample_size, 0,
+//                                               param->forest->max_depth);
+//         free(subsample);
+//     }
+//     return NULL;
+// }
+
+isolation_forest* iforest_init(int num_trees, int num_samples, int num_features,
+                               int num_threads, double contamination, uint32_t random_state)
+{
+    if (!(contamination == 0 || (contamination > 0 && contamination <= 0.5))) {
+        printf("Contamination must be 0 (auto) or in (0, 0.5].\n");
+        return NULL;
+    }
+
+    isolation_forest* forest = calloc(1, sizeof(isolation_forest));
+    if (forest == NULL) {
+        return NULL;
+    }
+
+    forest->num_trees     = num_trees;
+    forest->num_samples   = num_samples;
+    forest->max_depth     = (int)(ceil(log2(num_samples > 2 ? num_samples : 2))) + 2;
+    forest->num_threads   = num_threads;
+    forest->num_features  = num_features;
+    forest->contamination = contamination;
+    forest->random_state  = random_state;
+
+    // Incremental training defaults, see iforest_set_window
+    forest->window_size     = 8 * (uint64_t)(num_samples > 0 ? num_samples : 1);
+    forest->trees_per_batch = (num_trees >= 10) ? num_trees / 10 : 1;
+    atomic_init(&forest->model, NULL);
+    atomic_init(&forest->epoch, 0);
+    pthread_mutex_init(&forest->publish_lock, NULL);
+
+    forest->trees = calloc(num_trees, sizeof(itree_node*));
+    if (forest->trees == NULL) {
+        forest->num_trees = 0;
+    }
+
+    // Leaf corrections are looked up by leaf size while training
+    forest->path_table = malloc(((num_samples > 0) ? num_samples + 1 : 1) * sizeof(double));
+    for (int n = 0; forest->path_table && n <= num_samples; n++) {
+        forest->path_table[n] = average_path_length(n);
+    }
+
+    forest->slots = aligned_alloc(_Alignof(reader_slot), READER_SLOTS * sizeof(reader_slot));
+    forest->pool  = thread_pool_create(num_threads);
+    if (forest->path_table == NULL || forest->slots == NULL || forest->pool == NULL) {
+        thread_pool_free(forest->pool);
+        free(forest->path_table);
+        pthread_mutex_destroy(&forest->publish_lock);
+        free(forest->slots);
+        free(forest->trees);
+        free(forest);
+        return NULL;
+    }
+    for (int i = 0; i < READER_SLOTS; i++) {
+        atomic_init(&forest->slots[i].active[0], 0);
+        atomic_init(&forest->slots[i].active[1], 0);
+    }
+
+    return forest;
+}
+
+static double fit_threshold(isolation_forest* forest, const iforest_model* model, const ndarray_t* X, int use_pool);
+
+// Nonzeros per normal for rows of n_features, the extension level is capped at n_features - 1
+static int forest_ext_k(const isolation_forest* forest, int n_features)
+{
+    int level = (forest->extension_level < n_features - 1) ? forest->extension_level : n_features - 1;
+    return (level > 0) ? level + 1 : 0;
+}
+
+int iforest_set_extension_level(isolation_forest* forest, int extension_level)
+{
+    if (extension_level < 0 || (forest->num_features > 0 && extension_level >= forest->num_features)) {
+        return -1;
+    }
+    forest->extension_level = extension_level;
+    return 0;
+}
+
+int iforest_set_histogram(isolation_forest* forest, int num_bins)
+{
+    // Bins are stored in one byte per row and feature
+    if (num_bins != 0 && (num_bins < 2 || num_bins > 256)) {
+        return -1;
+    }
+    forest->histogram_bins = num_bins;
+    return 0;
+}
+
+void iforest_train(isolation_forest* forest, ndarray_t* data)
+{
+    if (data->nd != 2 || (data->dtype != 'd' && data->dtype != 'f')) {
+        printf("Training data must be a 2D ndarray of dtype 'd' or 'f'.\n");
+        return;
+    }
+    if (data->dimensions[1] != (uint64_t)forest->num_features) {
+        printf("Training data has %llu features, the forest expects %d.\n", (unsigned long long)data->dimensions[1],
+               forest->num_features);
+        return;
+    }
+
+    // Trees read each row as one run of features, views with other strides are copied once
+    ndarray_t* packed = NULL;
+    if (data->strides[1] != (data->dtype == 'f' ? sizeof(float) : sizeof(double)) && data->dimensions[1] > 1) {
+        packed = ndarray_copy(data);
+        if (packed == NULL) {
+            printf("Memory allocation failed.\n");
+            return;
+        }
+        data = packed;
+    }
+
+    // Size arena chunks for the trees a worker is expected to build, about
+    // 2 * num_samples nodes each, so most workers never need a second chunk.
+    // Extended splits also hold their normal, in about num_samples internal nodes.
+    int ext_k           = forest_ext_k(forest, data->dimensions[1]);
+    int num_workers     = thread_pool_size(forest->pool);
+    uint64_t tree_rows  = ((uint64_t)forest->num_samples < data->dimensions[0]) ? (uint64_t)forest->num_samples : data->dimensions[0];
+    size_t tree_nodes   = 2 * tree_rows + 1 + (ext_k ? tree_rows * normal_slots(ext_k, data->dtype) : 0);
+    size_t worker_trees = (forest->num_trees + num_workers - 1) / num_workers;
+    node_arena* arenas  = calloc(num_workers, sizeof(node_arena));
+    if (arenas == NULL) {
+        printf("Memory allocation failed.\n");
+        if (packed) ndarray_free(packed);
+        return;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        arenas[i].chunk_nodes = (tree_nodes * worker_trees < ARENA_MAX_CHUNK_NODES) ? tree_nodes * worker_trees : ARENA_MAX_CHUNK_NODES;
+    }
+
+    build_ctx ctx;
+    ctx.forest          = forest;
+    ctx.data            = data;
+    ctx.arenas          = arenas;
+    ctx.ext_k           = ext_k;
+    ctx.hist            = NULL;
+    ctx.tasks           = NULL;
+    ctx.pending         = 0;
+    ctx.next_tree       = 0;
+    ctx.subtree_workers = 0;
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+
+    // Row indices are 32-bit, larger sets fall back to exact splits
+    if (forest->histogram_bins && !ext_k && data->dimensions[0] <= INT32_MAX) {
+        ctx.hist = train_histogram_build(data, forest->histogram_bins);
+    }
+
+    pthread_once(&project_rows_once, project_rows_dispatch);
+    thread_pool_run(forest->pool, build_trees_worker, &ctx);
+
+    pthread_mutex_destroy(&ctx.lock);
+    pthread_cond_destroy(&ctx.cond);
+    train_histogram_free(ctx.hist);
+    forest->subtree_workers = ctx.subtree_workers;
+
+    // Scoring threads keep the previous model until the new one is in place
+    iforest_model* model = flatten_forest(NULL, forest->trees, forest->num_trees, data->dimensions[1], data->dtype, ext_k);
+    if (model == NULL) {
+        printf("Memory allocation failed.\n");
+    } else {
+        model->threshold = fit_threshold(forest, model, data, 1);
+        pthread_mutex_lock(&forest->publish_lock);
+        model_publish(forest, model);
+        pthread_mutex_unlock(&forest->publish_lock);
+    }
+
+    // Drop every training node in one go
+    for (int i = 0; i < num_workers; i++) {
+        arena_free(&arenas[i]);
+    }
+    free(arenas);
+    memset(forest->trees, 0, forest->num_trees * sizeof(itree_node*));
+    if (packed) ndarray_free(packed);
+}
+
+int iforest_subtree_workers(const isolation_forest* forest)
+{
+    return forest->subtree_workers;
+}
+
+int iforest_publish(isolation_forest* forest, isolation_forest* source)
+{
+    if (forest == NULL || source == NULL || forest == source || source->num_samples != forest->num_samples) {
+        return -1;
+    }
+
+    // source is private to the caller, its model is taken without a grace period
+    pthread_mutex_lock(&source->publish_lock);
+    iforest_model* model = atomic_exchange(&source->model, NULL);
+    pthread_mutex_unlock(&source->publish_lock);
+    if (model == NULL) {
+        return -1;
+    }
+
+    // Scoring reads rows as wide as the model that was built, not as num_features was set
+    pthread_mutex_lock(&forest->publish_lock);
+    const iforest_model* live = atomic_load(&forest->model);
+    int status                = 0;
+    if (model->num_features != forest->num_features || (live != NULL && live->num_features != model->num_features)) {
+        status = -1;
+    } else {
+        model_publish(forest, model);
+    }
+    pthread_mutex_unlock(&forest->publish_lock);
+
+    if (status != 0) {
+        pthread_mutex_lock(&source->publish_lock);
+        atomic_store(&source->model, model);
+        pthread_mutex_unlock(&source->publish_lock);
+    }
+    return status;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Compact copy of a full model: per-feature bin edges taken from its split thresholds,
+// all of them while a feature has fewer than max_bins distinct ones and quantiles of them
+// otherwise. Each threshold snaps to its nearest edge and leaves keep 16-bit path lengths.
+static iforest_model* quantize_model(const iforest_model* full, int max_bins)
+{
+    if (full == NULL || full->qwidth || full->ext_k || full->num_features > 0xFFFF) {
+        return NULL;
+    }
+    for (int t = 0; t < full->num_trees; t++) {
+        if (full->tree_offset[t + 1] - full->tree_offset[t] > 0xFFFF) {
+            return NULL;
+        }
+    }
+
+    // Thresholds grouped by feature and sorted, start[f] is the first of feature f
+    int num_features = full->num_features;
+    int32_t* start   = calloc(num_features + 1, sizeof(int32_t));
+    int32_t* cursor  = malloc(num_features * sizeof(int32_t));
+    double* values   = malloc(full->num_nodes * sizeof(double));
+    double* edges    = malloc(full->num_nodes * sizeof(double));
+    int32_t* offset  = malloc((num_features + 1) * sizeof(int32_t));
+    if (start == NULL || cursor == NULL || values == NULL || edges == NULL || offset == NULL) {
+        printf("Memory allocation failed.\n");
+        free(start);
+        free(cursor);
+        free(values);
+        free(edges);
+        free(offset);
+        return NULL;
+    }
+    double max_leaf = 0;
+    for (int32_t i = 0; i < full->num_nodes; i++) {
+        if (full->split_feature[i] >= 0) start[full->split_feature[i] + 1]++;
+    }
+    for (int f = 0; f < num_features; f++) {
+        start[f + 1] += start[f];
+        cursor[f] = start[f];
+    }
+    for (int32_t i = 0; i < full->num_nodes; i++) {
+        double value = (full->dtype == 'f') ? ((const float*)full->split_value)[i] : ((const double*)full->split_value)[i];
+        if (full->split_feature[i] >= 0) {
+            values[cursor[full->split_feature[i]]++] = value;
+        } else if (value > max_leaf) {
+            max_leaf = value;
+        }
+    }
+
+    int num_edges = 0;
+    for (int f = 0; f < num_features; f++) {
+        double* v = values + start[f];
+        int n     = start[f + 1] - start[f];
+        qsort(v, n, sizeof(double), compare_double);
+        int distinct = 0;
+        for (int i = 0; i < n; i++) {
+            distinct += (i == 0 || v[i] != v[i - 1]);
+        }
+        offset[f] = num_edges;
+        if (distinct < max_bins) {
+            // Every distinct threshold is an edge, the feature's splits stay exact
+            for (int i = 0; i < n; i++) {
+                if (i == 0 || v[i] != v[i - 1]) edges[num_edges++] = v[i];
+            }
+        } else {
+            // Quantiles of the thresholds, bins are narrow where splits are dense
+            for (int b = 0; b < max_bins - 1; b++) {
+                double edge = v[(size_t)((b + 0.5) * n / (max_bins - 1))];
+                if (num_edges == offset[f] || edge > edges[num_edges - 1]) edges[num_edges++] = edge;
+            }
+        }
+    }
+    offset[num_features] = num_edges;
+
+    int width            = (max_bins <= 0x100 && num_features <= 0xFF) ? 1 : 2;
+    iforest_model shape  = {.num_trees = full->num_trees, .num_nodes = full->num_nodes, .num_features = num_features,
+                            .dtype = full->dtype, .qwidth = width, .num_edges = num_edges};
+    iforest_model* model = model_alloc(&shape);
+    if (model != NULL) {
+        memcpy(model->tree_offset, full->tree_offset, (full->num_trees + 1) * sizeof(int32_t));
+        memcpy(model->bin_offset, offset, (num_features + 1) * sizeof(int32_t));
+        memcpy(model->bin_edges, edges, num_edges * sizeof(double));
+        model->threshold  = full->threshold;
+        model->path_scale = full->path_scale;
+        model->leaf_scale = (max_leaf > 0) ? max_leaf / 0xFFFF : 1;
+
+        for (int32_t i = 0; i < full->num_nodes; i++) {
+            int32_t feature = full->split_feature[i];
+            double value    = (full->dtype == 'f') ? ((const float*)full->split_value)[i] : ((const double*)full->split_value)[i];
+            if (feature < 0) {
+                quant_store(model->qfeature, width, i, QUANT_LEAF(width));
+                quant_store(model->qcode, width, i, 0);
+                model->qchild[i] = (uint16_t)lround(value / model->leaf_scale);
+                continue;
+            }
+
+            // Nearest edge e, the row goes left when its bin is at most the index of e
+            const double* e = edges + offset[feature];
+            int m           = offset[feature + 1] - offset[feature];
+            int k           = 0;
+            int hi          = m;
+            while (k < hi) {
+                int mid = (k + hi) / 2;
+                if (e[mid] < value) {
+                    k = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            if (k == m || (k > 0 && value - e[k - 1] < e[k] - value)) k--;
+            quant_store(model->qfeature, width, i, feature);
+            quant_store(model->qcode, width, i, k + 1);
+            model->qchild[i] = (uint16_t)full->left_child[i];
+        }
+    }
+
+    free(start);
+    free(cursor);
+    free(values);
+    free(edges);
+    free(offset);
+    return model;
+}
+
+int iforest_quantize(isolation_forest* forest, int max_bins)
+{
+    if (forest == NULL || max_bins < 2 || max_bins > 0x10000) {
+        return -1;
+    }
+
+    // Publishers hold publish_lock, so the model being copied stays in place
+    pthread_mutex_lock(&forest->publish_lock);
+    iforest_model* model = quantize_model(atomic_load(&forest->model), max_bins);
+    if (model != NULL) {
+        model_publish(forest, model);
+    }
+    pthread_mutex_unlock(&forest->publish_lock);
+    return model ? 0 : -1;
+}
+
+int iforest_set_window(isolation_forest* forest, uint64_t window_size, int trees_per_batch)
+{
+    if (atomic_load(&forest->stream) != NULL || window_size < 2 || trees_per_batch < 1) {
+        return -1;
+    }
+    forest->window_size     = window_size;
+    forest->trees_per_batch = trees_per_batch;
+    return 0;
+}
+
+// Copy the last rows of X into the ring buffer, converting to the window dtype.
+// Caller holds stream->lock.
+static void stream_append(iforest_stream* stream, const ndarray_t* X)
+{
+    uint64_t n_rows  = X->dimensions[0];
+    uint64_t first   = (n_rows > stream->capacity) ? n_rows - stream->capacity : 0;
+    size_t type_size = (stream->dtype == 'f') ? sizeof(float) : sizeof(double);
+    size_t row_size  = stream->n_features * type_size;
+    int same_layout  = (X->dtype == stream->dtype && X->strides[1] == type_size);
+
+    for (uint64_t i = first; i < n_rows; i++) {
+        const uint8_t* src = (const uint8_t*)X->data + i * X->strides[0];
+        uint8_t* dst       = (uint8_t*)stream->rows + stream->head * row_size;
+        if (same_layout) {
+            memcpy(dst, src, row_size);
+        } else {
+            for (int j = 0; j < stream->n_features; j++) {
+                const uint8_t* cell = src + j * X->strides[1];
+                double value        = (X->dtype == 'd') ? *(const double*)cell : *(const float*)cell;
+                if (stream->dtype == 'f') {
+                    ((float*)dst)[j] = (float)value;
+                } else {
+                    ((double*)dst)[j] = value;
+                }
+            }
+        }
+        stream->head = (stream->head + 1) % stream->capacity;
+        if (stream->count < stream->capacity) stream->count++;
+    }
+}
+
+// Whether trees rebuilt for the window can replace some of base's, or must replace all
+static int stream_base_usable(const iforest_model* base, int num_trees, int n_features, char dtype, int ext_k)
+{
+    return base != NULL && base->num_trees == num_trees && base->num_features == n_features && base->dtype == dtype &&
+           base->ext_k == ext_k && !base->qwidth;
+}
+
+// Rebuild the oldest trees from the window and publish the result. Called by the
+// updater with stream->lock held, the lock is dropped except while rows are copied
+// out, so ingest goes on during the build. Returns -1 if another model was published
+// meanwhile and the update has to be redone against it.
+static int stream_update(isolation_forest* forest, iforest_stream* stream, int batches)
+{
+    int num_trees      = forest->num_trees;
+    itree_node** trees = calloc(num_trees, sizeof(itree_node*));
+    void*** rows       = calloc(num_trees, sizeof(void**));
+    uint8_t** copies   = calloc(num_trees, sizeof(uint8_t*));
+    iforest_rng* rngs  = calloc(num_trees, sizeof(iforest_rng));
+    if (trees == NULL || rows == NULL || copies == NULL || rngs == NULL) {
+        printf("Memory allocation failed.\n");
+        free(trees);
+        free(rows);
+        free(copies);
+        free(rngs);
+        return 0;
+    }
+
+    // Which trees to replace depends on the current model, only its shape is read
+    atomic_long* pin;
+    const iforest_model* base = model_acquire(forest, &pin);
+    char dtype                = stream->dtype;
+    int n_features            = stream->n_features;
+    int ext_k                 = forest_ext_k(forest, n_features);
+    int rebuild_all           = !stream_base_usable(base, num_trees, n_features, dtype, ext_k);
+    model_release(pin);
+    int64_t wanted = (int64_t)batches * forest->trees_per_batch;
+    int replace    = (rebuild_all || wanted > num_trees) ? num_trees : (int)wanted;
+    int first      = rebuild_all ? 0 : stream->next_tree;
+
+    // Sampled rows and the whole window, for the threshold, are copied out so ingest
+    // can overwrite the ring buffer during the build
+    size_t type_size     = (dtype == 'f') ? sizeof(float) : sizeof(double);
+    size_t row_size      = n_features * type_size;
+    uint64_t dims[2]     = {stream->count, n_features};
+    uint64_t strides[2]  = {row_size, type_size};
+    ndarray_t window     = {.data = stream->rows, .dimensions = dims, .strides = strides, .nd = 2, .dtype = dtype};
+    uint8_t* snapshot    = malloc(stream->count * row_size);
+    uint64_t sample_size = 0;
+    int failed           = (snapshot == NULL);
+    for (int k = 0; k < replace && !failed; k++) {
+        int tree      = (first + k) % num_trees;
+        uint64_t seed = ((uint64_t)forest->random_state << 32) | (uint32_t)tree;
+        rng_seed(&rngs[tree], seed ^ (stream->generation * 0x9E3779B97F4A7C15ull));
+
+        sample_size  = forest->num_samples;
+        rows[tree]   = ndarray_sample_without_replacement(&rngs[tree], &window, &sample_size);
+        copies[tree] = rows[tree] ? malloc(sample_size * row_size) : NULL;
+        if (copies[tree] == NULL) {
+            failed = 1;
+            break;
+        }
+        for (uint64_t i = 0; i < sample_size; i++) {
+            memcpy(copies[tree] + i * row_size, rows[tree][i], row_size);
+            rows[tree][i] = copies[tree] + i * row_size;
+        }
+    }
+    if (!failed) {
+        memcpy(snapshot, stream->rows, stream->count * row_size);
+        window.data       = snapshot;
+        stream->next_tree = (first + replace) % num_trees;
+        stream->generation++;
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    // Built on this thread alone, so ingest never takes pool workers away from scoring
+    size_t tree_nodes = 2 * sample_size + 1 + (ext_k ? sample_size * normal_slots(ext_k, dtype) : 0);
+    double* values    = malloc(sample_size * sizeof(double));
+    int32_t* index    = malloc(sample_size * sizeof(int32_t));
+    node_arena arena;
+    arena.head        = NULL;
+    arena.chunk_nodes = (tree_nodes * replace < ARENA_MAX_CHUNK_NODES) ? tree_nodes * replace : ARENA_MAX_CHUNK_NODES;
+    failed |= (values == NULL || index == NULL);
+    pthread_once(&project_rows_once, project_rows_dispatch);
+    for (int tree = 0; tree < num_trees && !failed; tree++) {
+        if (rows[tree] == NULL) continue;
+        for (uint64_t i = 0; i < sample_size; i++) {
+            index[i] = (int32_t)i;
+        }
+        tree_job job;
+        job.ctx        = NULL;
+        job.rows       = rows[tree];
+        job.dtype      = dtype;
+        job.n_features = n_features;
+        job.max_depth  = forest->max_depth;
+        job.ext_k      = ext_k;
+        job.values     = values;
+        job.path_table = forest->path_table;
+        job.hist       = NULL;
+        job.index      = index;
+        atomic_init(&job.refs, 1);
+        trees[tree] = create_node(&job, &arena, &rngs[tree], 0, (int)sample_size, 0);
+        failed      = (trees[tree] == NULL);
+    }
+    free(values);
+    free(index);
+
+    // Kept trees are copied from the model current under publish_lock. The threshold
+    // is fitted outside it, and the epoch shows whether another model came in meanwhile.
+    iforest_model* model = NULL;
+    unsigned epoch       = 0;
+    int stale            = 0;
+    if (!failed) {
+        pthread_mutex_lock(&forest->publish_lock);
+        base  = atomic_load(&forest->model);
+        epoch = atomic_load(&forest->epoch);
+        stale = !rebuild_all && !stream_base_usable(base, num_trees, n_features, dtype, ext_k);
+        model = stale ? NULL : flatten_forest(base, trees, num_trees, n_features, dtype, ext_k);
+        pthread_mutex_unlock(&forest->publish_lock);
+        failed = !stale && model == NULL;
+    }
+    if (model != NULL) {
+        model->threshold = fit_threshold(forest, model, &window, 0);
+        pthread_mutex_lock(&forest->publish_lock);
+        stale = (atomic_load(&forest->epoch) != epoch);
+        if (!stale) model_publish(forest, model);
+        pthread_mutex_unlock(&forest->publish_lock);
+        if (stale) model_free(model);
+    }
+    if (failed) {
+        printf("Memory allocation failed.\n");
+    }
+
+    arena_free(&arena);
+    for (int tree = 0; tree < num_trees; tree++) {
+        free(rows[tree]);
+        free(copies[tree]);
+    }
+    free(trees);
+    free(rows);
+    free(copies);
+    free(rngs);
+    free(snapshot);
+    pthread_mutex_lock(&stream->lock);
+    return stale ? -1 : 0;
+}
+
+static void* stream_updater(void* arg)
+{
+    iforest_stream* stream   = (iforest_stream*)arg;
+    isolation_forest* forest = stream->forest;
+
+    pthread_mutex_lock(&stream->lock);
+    for (;;) {
+        while (stream->pending == 0 && !stream->stop) {
+            pthread_cond_wait(&stream->wake, &stream->lock);
+        }
+        if (stream->stop) break;
+
+        // Batches that arrived during the last update are applied together
+        int batches     = stream->pending;
+        stream->pending = 0;
+        stream->busy    = 1;
+        if (stream_update(forest, stream, batches) != 0) {
+            // Another model came in during the build, apply the batches to it instead
+            stream->pending += batches;
+        }
+        stream->busy = 0;
+        pthread_cond_broadcast(&stream->idle);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+// Window rows take the trained model's shape, or the first batch's before training
+static iforest_stream* stream_create(isolation_forest* forest, const ndarray_t* X)
+{
+    iforest_stream* stream = calloc(1, sizeof(iforest_stream));
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    atomic_long* pin;
+    const iforest_model* model = model_acquire(forest, &pin);
+    stream->dtype              = model ? model->dtype : X->dtype;
+    stream->n_features         = model ? model->num_features : (int)X->dimensions[1];
+    model_release(pin);
+
+    size_t type_size = (stream->dtype == 'f') ? sizeof(float) : sizeof(double);
+    stream->forest   = forest;
+    stream->capacity = forest->window_size;
+    stream->rows     = malloc(stream->capacity * stream->n_features * type_size);
+    if (stream->rows == NULL) {
+        free(stream);
+        return NULL;
+    }
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->wake, NULL);
+    pthread_cond_init(&stream->idle, NULL);
+    return stream;
+}
+
+static void stream_free(iforest_stream* stream)
+{
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->wake);
+    pthread_cond_destroy(&stream->idle);
+    free(stream->rows);
+    free(stream);
+}
+
+int iforest_partial_fit(isolation_forest* forest, const ndarray_t* X)
+{
+    if (forest == NULL || X == NULL || X->nd != 2 || (X->dtype != 'd' && X->dtype != 'f') || X->dimensions[0] == 0 ||
+        X->dimensions[1] != (uint64_t)forest->num_features) {
+        return -1;
+    }
+
+    // The window and its updater are set up by the first batch, later calls only read the
+    // pointer. publish_lock is taken just for the setup, so ingest never waits on an update.
+    iforest_stream* stream = atomic_load(&forest->stream);
+    if (stream == NULL) {
+        pthread_mutex_lock(&forest->publish_lock);
+        stream = atomic_load(&forest->stream);
+        if (stream == NULL) {
+            stream = stream_create(forest, X);
+            if (stream != NULL && pthread_create(&stream->thread, NULL, stream_updater, stream) != 0) {
+                stream_free(stream);
+                stream = NULL;
+            }
+            atomic_store(&forest->stream, stream);
+        }
+        pthread_mutex_unlock(&forest->publish_lock);
+    }
+    if (stream == NULL) {
+        printf("Memory allocation failed.\n");
+        return -1;
+    }
+    if (X->dimensions[1] != (uint64_t)stream->n_features) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    stream_append(stream, X);
+    stream->pending++;
+    pthread_cond_signal(&stream->wake);
+    pthread_mutex_unlock(&stream->lock);
+    return 0;
+}
+
+void iforest_flush(isolation_forest* forest)
+{
+    iforest_stream* stream = atomic_load(&forest->stream);
+    if (stream == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    while (stream->pending > 0 || stream->busy) {
+        pthread_cond_wait(&stream->idle, &stream->lock);
+    }
+    pthread_mutex_unlock(&stream->lock);
+}
+
+// Map a summed path length over all trees to the anomaly score, 2^(-E(h(x)) / c(n))
+static inline double path_to_score(double total_path, const iforest_model* model)
+{
+    return exp2(-total_path / model->path_scale);
+}
+
+// A single row as the trees read it: x of dtype and, for quantized models, its bins.
+// bins is NULL for rows wider than QUANT_STACK_FEATURES, those are binned split by split.
+typedef struct {
+    const void* x;
+    char dtype;
+    const uint16_t* bins;
+} point_row;
+
+// Path length of a row in one tree, picked once per row by point_path
+typedef double (*point_path_fn)(const iforest_model* model, int tree, const point_row* row);
+
+static double point_path_d(const iforest_model* model, int tree, const point_row* row)
+{
+    return itree_get_path_len_d(model, tree, row->x);
+}
+
+static double point_path_f(const iforest_model* model, int tree, const point_row* row)
+{
+    return itree_get_path_len_f(model, tree, row->x);
+}
+
+static double point_path_fd(const iforest_model* model, int tree, const point_row* row)
+{
+    return itree_get_path_len_fd(model, tree, row->x);
+}
+
+static double point_path_df(const iforest_model* model, int tree, const point_row* row)
+{
+    return itree_get_path_len_df(model, tree, row->x);
+}
+
+static double point_path_q(const iforest_model* model, int tree, const point_row* row)
+{
+    return row->bins ? itree_get_path_len_q(model, tree, row->bins) : itree_get_path_len_q_row(model, tree, row->x, row->dtype);
+}
+
+// Inputs are always compared in the model's precision, a row of the other dtype is
+// converted value by value as the trees read it, so scores match the batch path exactly
+static point_path_fn point_path(const iforest_model* model, char dtype)
+{
+    if (model->qwidth) {
+        return point_path_q;
+    }
+    if (model->dtype == 'd') {
+        return (dtype == 'd') ? point_path_d : point_path_df;
+    }
+    return (dtype == 'f') ? point_path_f : point_path_fd;
+}
+
+// Describe x for point_path, a quantized model bins it once into the caller's bins
+// when it has at most QUANT_STACK_FEATURES features
+static point_path_fn point_prepare(const iforest_model* model, const void* x, char dtype, uint16_t* bins, point_row* row)
+{
+    row->x     = x;
+    row->dtype = dtype;
+    row->bins  = NULL;
+    if (model->qwidth && model->num_features <= QUANT_STACK_FEATURES) {
+        quant_bin_row(model, x, dtype, bins);
+        row->bins = bins;
+    }
+    return point_path(model, dtype);
+}
+
+static double score_point(const iforest_model* model, point_path_fn path, const point_row* row)
+{
+    double total_path = 0.0;
+    for (int i = 0; i < model->num_trees; i++) {
+        total_path += path(model, i, row);
+    }
+    return path_to_score(total_path, model);
+}
+
+static double score_single(isolation_forest* forest, const void* x, char dtype)
+{
+    atomic_long* pin;
+    const iforest_model* model = model_acquire(forest, &pin);
+    double score               = NAN;
+    if (model != NULL) {
+        uint16_t bins[QUANT_STACK_FEATURES];
+        point_row row;
+        point_path_fn path = point_prepare(model, x, dtype, bins, &row);
+        score              = score_point(model, path, &row);
+    }
+    model_release(pin);
+    return score;
+}
+
+double iforest_score(isolation_forest* forest, double* x)
+{
+    return score_single(forest, x, 'd');
+}
+
+double iforest_score_f(isolation_forest* forest, float* x)
+{
+    return score_single(forest, x, 'f');
+}
+
+// Path length held by node i if it is a leaf, NAN for split nodes
+static double model_leaf_value(const iforest_model* model, int32_t i)
+{
+    if (model->qwidth) {
+        int leaf = quant_load(model->qfeature, model->qwidth, i) == QUANT_LEAF(model->qwidth);
+        return leaf ? model->qchild[i] * model->leaf_scale : NAN;
+    }
+    if (model->split_feature[i] != -1) {
+        return NAN;
+    }
+    return (model->dtype == 'f') ? ((const float*)model->split_value)[i] : ((const double*)model->split_value)[i];
+}
+
+// Least and greatest total path length over trees [t, num_trees), for t in
+// [0, num_trees]: entries t and num_trees + 1 + t. Computed once per model, the
+// first caller to finish installs its copy.
+static const double* model_path_bounds(iforest_model* model)
+{
+    double* bounds = atomic_load(&model->path_bounds);
+    if (bounds != NULL) {
+        return bounds;
+    }
+
+    int num_trees = model->num_trees;
+    bounds        = malloc(2 * (num_trees + 1) * sizeof(double));
+    if (bounds == NULL) {
+        return NULL;
+    }
+
+    double* min_rest    = bounds;
+    double* max_rest    = bounds + num_trees + 1;
+    min_rest[num_trees] = 0;
+    max_rest[num_trees] = 0;
+    for (int t = num_trees - 1; t >= 0; t--) {
+        // A walk ends at some leaf, so the tree adds between its least and greatest leaf value
+        double min_leaf = INFINITY;
+        double max_leaf = -INFINITY;
+        for (int32_t i = model->tree_offset[t]; i < model->tree_offset[t + 1]; i++) {
+            double leaf = model_leaf_value(model, i);
+            if (isnan(leaf)) continue;
+            min_leaf = (leaf < min_leaf) ? leaf : min_leaf;
+            max_leaf = (leaf > max_leaf) ? leaf : max_leaf;
+        }
+        min_rest[t] = min_rest[t + 1] + min_leaf;
+        max_rest[t] = max_rest[t + 1] + max_leaf;
+    }
+
+    double* expected = NULL;
+    if (!atomic_compare_exchange_strong(&model->path_bounds, &expected, bounds)) {
+        free(bounds);
+        return expected;
+    }
+    return bounds;
+}
+
+// Total path length where the score crosses threshold, widened by a margin that
+// covers rounding in the sums and in the score. Totals outside [low, high] are
+// decided by the bounds alone, anything closer is settled on the exact score.
+static path_cutoff predict_cutoff(const iforest_model* model, const double* bounds, double threshold)
+{
+    double boundary = -log2(threshold) * model->path_scale;
+    double margin   = 1e-9 * (bounds[model->num_trees + 1] + 1);
+    path_cutoff cut;
+    cut.threshold = threshold;
+    cut.low       = boundary - margin;
+    cut.high      = boundary + margin;
+    return cut;
+}
+
+// Trees are walked in order until the trees left cannot move the total across the cutoff
+static int predict_point(const iforest_model* model, const double* bounds, const path_cutoff* cut, point_path_fn path,
+                         const point_row* row, int* trees_evaluated)
+{
+    const double* min_rest = bounds;
+    const double* max_rest = bounds + model->num_trees + 1;
+    double total           = 0;
+    int t                  = 0;
+    while (t < model->num_trees) {
+        total += path(model, t, row);
+        t++;
+        if (total + max_rest[t] < cut->low) {
+            *trees_evaluated = t;
+            return -1;
+        }
+        if (total + min_rest[t] > cut->high) {
+            *trees_evaluated = t;
+            return 1;
+        }
+    }
+    *trees_evaluated = t;
+    return (path_to_score(total, model) > cut->threshold) ? -1 : 1;
+}
+
+int iforest_predict(isolation_forest* forest, double* x, double threshold, int* trees_evaluated)
+{
+    atomic_long* pin;
+    iforest_model* model  = (iforest_model*)model_acquire(forest, &pin);
+    const double* bounds = model ? model_path_bounds(model) : NULL;
+    int evaluated        = 0;
+    int label            = 0;
+    if (bounds != NULL) {
+        path_cutoff cutoff = predict_cutoff(model, bounds, threshold);
+        uint16_t bins[QUANT_STACK_FEATURES];
+        point_row row;
+        point_path_fn path = point_prepare(model, x, 'd', bins, &row);
+        label              = predict_point(model, bounds, &cutoff, path, &row, &evaluated);
+    }
+    model_release(pin);
+    if (trees_evaluated) *trees_evaluated = evaluated;
+    return label;
+}
+
+typedef void (*score_tile_d_fn)(const iforest_model* model, const double* base, int64_t stride, int n, double* out);
+typedef void (*score_tile_f_fn)(const iforest_model* model, const float* base, int64_t stride, int n, double* out);
+
+// Advance a tile of rows through each tree together, so the dependent
+// node loads of one row overlap with those of the other rows in the tile.
+// Row r of the tile starts at base + r * stride.
+static void score_tile_d(const iforest_model* model, const double* base, int64_t stride, int n, double* out)
+{
+    double path[SCORE_TILE] = {0};
+    int32_t idx[SCORE_TILE];
+
+    for (int t = 0; t < model->num_trees; t++) {
+        int32_t offset               = model->tree_offset[t];
+        const int32_t* split_feature = model->split_feature + offset;
+        const double* split_value    = (const double*)model->split_value + offset;
+        const int32_t* left_child    = model->left_child + offset;
+
+        for (int r = 0; r < n; r++) {
+            idx[r] = 0;
+        }
+
+        // Branch-free step: rows already at a leaf read feature 0 and keep their index
+        int active = n;
+        while (active) {
+            active = 0;
+            for (int r = 0; r < n; r++) {
+                int32_t node    = idx[r];
+                int32_t feature = split_feature[node];
+                int is_split    = feature >= 0;
+                double x        = base[r * stride + (feature & -is_split)];
+                int32_t next    = left_child[node] + !(x < split_value[node]);
+                idx[r]          = is_split ? next : node;
+                active |= is_split;
+            }
+        }
+
+        // Every row is at its leaf, which holds the rest of its path length
+        for (int r = 0; r < n; r++) {
+            path[r] += split_value[idx[r]];
+        }
+    }
+
+    for (int r = 0; r < n; r++) {
+        out[r] = path_to_score(path[r], model);
+    }
+}
+
+static void score_tile_f(const iforest_model* model, const float* base, int64_t stride, int n, double* out)
+{
+    double path[SCORE_TILE] = {0};
+    int32_t idx[SCORE_TILE];
+
+    for (int t = 0; t < model->num_trees; t++) {
+        int32_t offset               = model->tree_offset[t];
+        const int32_t* split_feature = model->split_feature + offset;
+        const float* split_value     = (const float*)model->split_value + offset;
+        const int32_t* left_child    = model->left_child + offset;
+
+        for (int r = 0; r < n; r++) {
+            idx[r] = 0;
+        }
+
+        int active = n;
+        while (active) {
+            active = 0;
+            for (int r = 0; r < n; r++) {
+                int32_t node    = idx[r];
+                int32_t feature = split_feature[node];
+                int is_split    = feature >= 0;
+                float x         = base[r * stride + (feature & -is_split)];
+                int32_t next    = left_child[node] + !(x < split_value[node]);
+                idx[r]          = is_split ? next : node;
+                active |= is_split;
+            }
+        }
+
+        // Every row is at its leaf, which holds the rest of its path length
+        for (int r = 0; r < n; r++) {
+            path[r] += split_value[idx[r]];
+        }
+    }
+
+    for (int r = 0; r < n; r++) {
+        out[r] = path_to_score(path[r], model);
+    }
+}
+
+// Extended models walk one row at a time, each step projects the row on the node's normal
+static void score_tile_ext_d(const iforest_model* model, const double* base, int64_t stride, int n, double* out)
+{
+    for (int r = 0; r < n; r++) {
+        double path = 0;
+        for (int t = 0; t < model->num_trees; t++) {
+            path += itree_get_path_len_ext_d(model, t, base + r * stride);
+        }
+        out[r] = path_to_score(path, model);
+    }
+}
+
+static void score_tile_ext_f(const iforest_model* model, const float* base, int64_t stride, int n, double* out)
+{
+    for (int r = 0; r < n; r++) {
+        double path = 0;
+        for (int t = 0; t < model->num_trees; t++) {
+            path += itree_get_path_len_ext_f(model, t, base + r * stride);
+        }
+        out[r] = path_to_score(path, model);
+    }
+}
+
+// Float kernels gather with 32-bit offsets from the tile's first row, rows further apart
+// than that allows are walked by the scalar kernel
+static inline int tile_offsets_fit(int64_t stride, int num_features)
+{
+    return stride >= 0 && stride <= (INT32_MAX - num_features) / (SCORE_TILE - 1);
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+// Same walk as score_tile_d, 4 rows per AVX2 vector. Features, thresholds and
+// children are gathered per lane, rows at a leaf are masked out of the update.
+__attribute__((target("avx2"))) static void score_tile_d_avx2(const iforest_model* model, const double* base, int64_t stride, int n, double* out)
+{
+    if (n != SCORE_TILE) {
+        score_tile_d(model, base, stride, n, out);
+        return;
+    }
+
+    enum { LANES = 4, VECS = SCORE_TILE / 4 };
+    const __m256i pack_lo = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    __m256i row_offset[VECS];
+    __m256d path[VECS];
+    for (int v = 0; v < VECS; v++) {
+        int64_t r     = v * LANES;
+        row_offset[v] = _mm256_setr_epi64x(r * stride, (r + 1) * stride, (r + 2) * stride, (r + 3) * stride);
+        path[v]       = _mm256_setzero_pd();
+    }
+
+    for (int t = 0; t < model->num_trees; t++) {
+        int32_t offset               = model->tree_offset[t];
+        const int32_t* split_feature = model->split_feature + offset;
+        const double* split_value    = (const double*)model->split_value + offset;
+        const int32_t* left_child    = model->left_child + offset;
+
+        __m128i idx[VECS];
+        for (int v = 0; v < VECS; v++) {
+            idx[v] = _mm_setzero_si128();
+        }
+
+        int active = 1;
+        while (active) {
+            active = 0;
+            for (int v = 0; v < VECS; v++) {
+                __m128i feature  = _mm_i32gather_epi32((const int*)split_feature, idx[v], 4);
+                __m128i is_split = _mm_cmpgt_epi32(feature, _mm_set1_epi32(-1));
+                feature          = _mm_and_si128(feature, is_split);
+
+                __m256i cell   = _mm256_add_epi64(row_offset[v], _mm256_cvtepi32_epi64(feature));
+                __m256d x      = _mm256_i64gather_pd(base, cell, 8);
+                __m256d value  = _mm256_i32gather_pd(split_value, idx[v], 8);
+                __m128i left   = _mm_i32gather_epi32((const int*)left_child, idx[v], 4);
+                __m256i right  = _mm256_castpd_si256(_mm256_cmp_pd(x, value, _CMP_NLT_UQ));
+                __m128i right4 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(right, pack_lo));
+                __m128i next   = _mm_sub_epi32(left, right4);
+
+                idx[v]   = _mm_blendv_epi8(idx[v], next, is_split);
+                active |= _mm_movemask_epi8(is_split);
+            }
+        }
+
+        for (int v = 0; v < VECS; v++) {
+            path[v] = _mm256_add_pd(path[v], _mm256_i32gather_pd(split_value, idx[v], 8));
+        }
+    }
+
+    for (int v = 0; v < VECS; v++) {
+        double total[LANES];
+        _mm256_storeu_pd(total, path[v]);
+        for (int l = 0; l < LANES; l++) {
+            out[v * LANES + l] = path_to_score(total[l], model);
+        }
+    }
+}
+
+// Float rows fill 8 lanes per AVX2 vector and need no 64-bit index widening
+__attribute__((target("avx2"))) static void score_tile_f_avx2(const iforest_model* model, const float* base, int64_t stride, int n, double* out)
+{
+    if (n != SCORE_TILE || !tile_offsets_fit(stride, model->num_features)) {
+        score_tile_f(model, base, stride, n, out);
+        return;
+    }
+
+    enum { LANES = 8, VECS = SCORE_TILE / 8 };
+    __m256i row_offset[VECS];
+    __m256d path[2 * VECS];
+    for (int v = 0; v < VECS; v++) {
+        row_offset[v] = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_set1_epi32(v * LANES), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)),
+                                           _mm256_set1_epi32((int32_t)stride));
+        path[2 * v]     = _mm256_setzero_pd();
+        path[2 * v + 1] = _mm256_setzero_pd();
+    }
+
+    for (int t = 0; t < model->num_trees; t++) {
+        int32_t offset               = model->tree_offset[t];
+        const int32_t* split_feature = model->split_feature + offset;
+        const float* split_value     = (const float*)model->split_value + offset;
+        const int32_t* left_child    = model->left_child + offset;
+
+        __m256i idx[VECS];
+        for (int v = 0; v < VECS; v++) {
+            idx[v] = _mm256_setzero_si256();
+        }
+
+        int active = 1;
+        while (active) {
+            active = 0;
+            for (int v = 0; v < VECS; v++) {
+                __m256i feature  = _mm256_i32gather_epi32((const int*)split_feature, idx[v], 4);
+                __m256i is_split = _mm256_cmpgt_epi32(feature, _mm256_set1_epi32(-1));
+                feature          = _mm256_and_si256(feature, is_split);
+
+                __m256 x      = _mm256_i32gather_ps(base, _mm256_add_epi32(row_offset[v], feature), 4);
+                __m256 value  = _mm256_i32gather_ps(split_value, idx[v], 4);
+                __m256i left  = _mm256_i32gather_epi32((const int*)left_child, idx[v], 4);
+                __m256i right = _mm256_castps_si256(_mm256_cmp_ps(x, value, _CMP_NLT_UQ));
+                __m256i next  = _mm256_sub_epi32(left, right);
+
+                idx[v]   = _mm256_blendv_epi8(idx[v], next, is_split);
+                active |= _mm256_movemask_epi8(is_split);
+            }
+        }
+
+        // Float leaves are summed in double, like the scalar walk
+        for (int v = 0; v < VECS; v++) {
+            __m256 leaf     = _mm256_i32gather_ps(split_value, idx[v], 4);
+            path[2 * v]     = _mm256_add_pd(path[2 * v], _mm256_cvtps_pd(_mm256_castps256_ps128(leaf)));
+            path[2 * v + 1] = _mm256_add_pd(path[2 * v + 1], _mm256_cvtps_pd(_mm256_extractf128_ps(leaf, 1)));
+        }
+    }
+
+    for (int v = 0; v < VECS; v++) {
+        double total[LANES];
+        _mm256_storeu_pd(total, path[2 * v]);
+        _mm256_storeu_pd(total + 4, path[2 * v + 1]);
+        for (int l = 0; l < LANES; l++) {
+            out[v * LANES + l] = path_to_score(total[l], model);
+        }
+    }
+}
+
+// Extended walk, 4 rows per AVX2 vector. Each lane gathers its node's normal and the
+// matching row values and accumulates the projection with FMA in feature order, so it
+// rounds like project_d. Leaves have zero normals and are masked out of the update.
+__attribute__((target("avx2,fma"))) static void score_tile_ext_d_avx2(const iforest_model* model, const double* base, int64_t stride, int n, double* out)
+{
+    if (n != SCORE_TILE) {
+        score_tile_ext_d(model, base, stride, n, out);
+        return;
+    }
+
+    enum { LANES = 4, VECS = SCORE_TILE / 4 };
+    const __m256i pack_lo = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    const int k           = model->ext_k;
+    __m256i row_offset[VECS];
+    __m256d path[VECS];
+    for (int v = 0; v < VECS; v++) {
+        int64_t r     = v * LANES;
+        row_offset[v] = _mm256_setr_epi64x(r * stride, (r + 1) * stride, (r + 2) * stride, (r + 3) * stride);
+        path[v]       = _mm256_setzero_pd();
+    }
+
+    for (int t = 0; t < model->num_trees; t++) {
+        int32_t offset                = model->tree_offset[t];
+        const int32_t* split_feature  = model->split_feature + offset;
+        const double* split_value     = (const double*)model->split_value + offset;
+        const int32_t* left_child     = model->left_child + offset;
+        const int32_t* normal_feature = model->normal_feature + (size_t)offset * k;
+        const double* normal_weight   = (const double*)model->normal_weight + (size_t)offset * k;
+
+        __m128i idx[VECS];
+        for (int v = 0; v < VECS; v++) {
+            idx[v] = _mm_setzero_si128();
+        }
+
+        int active = 1;
+        while (active) {
+            active = 0;
+            for (int v = 0; v < VECS; v++) {
+                __m128i feature  = _mm_i32gather_epi32((const int*)split_feature, idx[v], 4);
+                __m128i is_split = _mm_cmpgt_epi32(feature, _mm_set1_epi32(-1));
+                if (!_mm_movemask_epi8(is_split)) continue;
+
+                __m128i slot = _mm_mullo_epi32(idx[v], _mm_set1_epi32(k));
+                __m256d p    = _mm256_setzero_pd();
+                for (int j = 0; j < k; j++) {
+                    __m128i lane_slot = _mm_add_epi32(slot, _mm_set1_epi32(j));
+                    __m128i column    = _mm_i32gather_epi32((const int*)normal_feature, lane_slot, 4);
+                    __m256d weight    = _mm256_i32gather_pd(normal_weight, lane_slot, 8);
+                    __m256d x         = _mm256_i64gather_pd(base, _mm256_add_epi64(row_offset[v], _mm256_cvtepi32_epi64(column)), 8);
+                    p                 = _mm256_fmadd_pd(weight, x, p);
+                }
+
+                __m256d value  = _mm256_i32gather_pd(split_value, idx[v], 8);
+                __m128i left   = _mm_i32gather_epi32((const int*)left_child, idx[v], 4);
+                __m256i right  = _mm256_castpd_si256(_mm256_cmp_pd(p, value, _CMP_NLT_UQ));
+                __m128i right4 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(right, pack_lo));
+                __m128i next   = _mm_sub_epi32(left, right4);
+
+                idx[v]   = _mm_blendv_epi8(idx[v], next, is_split);
+                active   = 1;
+            }
+        }
+
+        for (int v = 0; v < VECS; v++) {
+            path[v] = _mm256_add_pd(path[v], _mm256_i32gather_pd(split_value, idx[v], 8));
+        }
+    }
+
+    for (int v = 0; v < VECS; v++) {
+        double total[LANES];
+        _mm256_storeu_pd(total, path[v]);
+        for (int l = 0; l < LANES; l++) {
+            out[v * LANES + l] = path_to_score(total[l], model);
+        }
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void score_tile_ext_f_avx2(const iforest_model* model, const float* base, int64_t stride, int n, double* out)
+{
+    if (n != SCORE_TILE || !tile_offsets_fit(stride, model->num_features)) {
+        score_tile_ext_f(model, base, stride, n, out);
+        return;
+    }
+
+    enum { LANES = 8, VECS = SCORE_TILE / 8 };
+    const int k = model->ext_k;
+    __m256i row_offset[VECS];
+    __m256d path[2 * VECS];
+    for (int v = 0; v < VECS; v++) {
+        row_offset[v] = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_set1_epi32(v * LANES), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)),
+                                           _mm256_set1_epi32((int32_t)stride));
+        path[2 * v]     = _mm256_setzero_pd();
+        path[2 * v + 1] = _mm256_setzero_pd();
+    }
+
+    for (int t = 0; t < model->num_trees; t++) {
+        int32_t offset                = model->tree_offset[t];
+        const int32_t* split_feature  = model->split_feature + offset;
+        const float* split_value      = (const float*)model->split_value + offset;
+        const int32_t* left_child     = model->left_child + offset;
+        const int32_t* normal_feature = model->normal_feature + (size_t)offset * k;
+        const float* normal_weight    = (const float*)model->normal_weight + (size_t)offset * k;
+
+        __m256i idx[VECS];
+        for (int v = 0; v < VECS; v++) {
+            idx[v] = _mm256_setzero_si256();
+        }
+
+        int active = 1;
+        while (active) {
+            active = 0;
+            for (int v = 0; v < VECS; v++) {
+                __m256i feature  = _mm256_i32gather_epi32((const int*)split_feature, idx[v], 4);
+                __m256i is_split = _mm256_cmpgt_epi32(feature, _mm256_set1_epi32(-1));
+                if (!_mm256_movemask_epi8(is_split)) continue;
+
+                __m256i slot = _mm256_mullo_epi32(idx[v], _mm256_set1_epi32(k));
+                __m256 p     = _mm256_setzero_ps();
+                for (int j = 0; j < k; j++) {
+                    __m256i lane_slot = _mm256_add_epi32(slot, _mm256_set1_epi32(j));
+                    __m256i column    = _mm256_i32gather_epi32((const int*)normal_feature, lane_slot, 4);
+                    __m256 weight     = _mm256_i32gather_ps(normal_weight, lane_slot, 4);
+                    __m256 x          = _mm256_i32gather_ps(base, _mm256_add_epi32(row_offset[v], column), 4);
+                    p                 = _mm256_fmadd_ps(weight, x, p);
+                }
+
+                __m256 value  = _mm256_i32gather_ps(split_value, idx[v], 4);
+                __m256i left  = _mm256_i32gather_epi32((const int*)left_child, idx[v], 4);
+                __m256i right = _mm256_castps_si256(_mm256_cmp_ps(p, value, _CMP_NLT_UQ));
+                __m256i next  = _mm256_sub_epi32(left, right);
+
+                idx[v]   = _mm256_blendv_epi8(idx[v], next, is_split);
+                active   = 1;
+            }
+        }
+
+        // Float leaves are summed in double, like the scalar walk
+        for (int v = 0; v < VECS; v++) {
+            __m256 leaf     = _mm256_i32gather_ps(split_value, idx[v], 4);
+            path[2 * v]     = _mm256_add_pd(path[2 * v], _mm256_cvtps_pd(_mm256_castps256_ps128(leaf)));
+            path[2 * v + 1] = _mm256_add_pd(path[2 * v + 1], _mm256_cvtps_pd(_mm256_extractf128_ps(leaf, 1)));
+        }
+    }
+
+    for (int v = 0; v < VECS; v++) {
+        double total[LANES];
+        _mm256_storeu_pd(total, path[2 * v]);
+        _mm256_storeu_pd(total + 4, path[2 * v + 1]);
+        for (int l = 0; l < LANES; l++) {
+            out[v * LANES + l] = path_to_score(total[l], model);
+        }
+    }
+}
+
+// 8 rows per AVX-512 vector, leaf lanes read feature 0 and keep their index
+__attribute__((target("avx512f"))) static void score_tile_d_avx512(const iforest_model* model, const double* base, int64_t stride, int n, double* out)
+{
+    if (n != SCORE_TILE) {
+        score_tile_d(model, base, stride, n, out);
+        return;
+    }
+
+    enum { LANES = 8, VECS = SCORE_TILE / 8 };
+    __m512i row_offset[VECS];
+    __m512d path[VECS];
+    for (int v = 0; v < VECS; v++) {
+        int64_t r     = v * LANES;
+        row_offset[v] = _mm512_setr_epi64(r * stride, (r + 1) * stride, (r + 2) * stride, (r + 3) * stride,
+                                          (r + 4) * stride, (r + 5) * stride, (r + 6) * stride, (r + 7) * stride);
+        path[v]       = _mm512_setzero_pd();
+    }
+
+    for (int t = 0; t < model->num_trees; t++) {
+        int32_t offset               = model->tree_offset[t];
+        const int32_t* split_feature = model->split_feature + offset;
+        const double* split_value    = (const double*)model->split_value + offset;
+        const int32_t* left_child    = model->left_child + offset;
+
+        __m256i idx[VECS];
+        for (int v = 0; v < VECS; v++) {
+            idx[v] = _mm256_setzero_si256();
+        }
+
+        int active = 1;
+        while (active) {
+            active = 0;
+            for (int v = 0; v < VECS; v++) {
+                __m256i feature   = _mm256_i32gather_epi32((const int*)split_feature, idx[v], 4);
+                __mmask8 is_split = (__mmask8)~_mm256_movemask_ps(_mm256_castsi256_ps(feature));
+                if (!is_split) continue;
+
+                feature         = _mm256_max_epi32(feature, _mm256_setzero_si256());
+                __m512i cell    = _mm512_add_epi64(row_offset[v], _mm512_cvtepi32_epi64(feature));
+                __m512d x       = _mm512_i64gather_pd(cell, base, 8);
+                __m512d value   = _mm512_i32gather_pd(idx[v], split_value, 8);
+                __m256i left    = _mm256_i32gather_epi32((const int*)left_child, idx[v], 4);
+                __mmask16 right = _mm512_cmp_pd_mask(x, value, _CMP_NLT_UQ);
+                __m256i next    = _mm256_add_epi32(left, _mm512_castsi512_si256(_mm512_maskz_set1_epi32(right, 1)));
+
+                idx[v]   = _mm512_castsi512_si256(_mm512_mask_blend_epi32(is_split, _mm512_castsi256_si512(idx[v]), _mm512_castsi256_si512(next)));
+                active |= is_split;
+            }
+        }
+
+        for (int v = 0; v < VECS; v++) {
+            path[v] = _mm512_add_pd(path[v], _mm512_i32gather_pd(idx[v], split_value, 8));
+        }
+    }
+
+    for (int v = 0; v < VECS; v++) {
+        double total[LANES];
+        _mm512_storeu_pd(total, path[v]);
+        for (int l = 0; l < LANES; l++) {
+            out[v * LANES + l] = path_to_score(total[l], model);
+        }
+    }
+}
+
+// 16 float rows per AVX-512 vector
+__attribute__((target("avx512f"))) static void score_tile_f_avx512(const iforest_model* model, const float* base, int64_t stride, int n, double* out)
+{
+    if (n != SCORE_TILE || !tile_offsets_fit(stride, model->num_features)) {
+        score_tile_f(model, base, stride, n, out);
+        return;
+    }
+
+    enum { LANES = 16, VECS = SCORE_TILE / 16 };
+    const __m512i one = _mm512_set1_epi32(1);
+    __m512i row_offset[VECS];
+    __m512d path[2 * VECS];
+    for (int v = 0; v < VECS; v++) {
+        row_offset[v] = _mm512_mullo_epi32(_mm512_add_epi32(_mm512_set1_epi32(v * LANES), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)),
+                                           _mm512_set1_epi32((int32_t)stride));
+        path[2 * v]     = _mm512_setzero_pd();
+        path[2 * v + 1] = _mm512_setzero_pd();
+    }
+
+    for (int t = 0; t < model->num_trees; t++) {
+        int32_t offset               = model->tree_offset[t];
+        const int32_t* split_feature = model->split_feature + offset;
+        const float* split_value     = (const float*)model->split_value + offset;
+        const int32_t* left_child    = model->left_child + offset;
+
+        __m512i idx[VECS];
+        for (int v = 0; v < VECS; v++) {
+            idx[v] = _mm512_setzero_si512();
+        }
+
+        int active = 1;
+        while (active) {
+            active = 0;
+            for (int v = 0; v < VECS; v++) {
+                __m512i feature    = _mm512_i32gather_epi32(idx[v], split_feature, 4);
+                __mmask16 is_split = _mm512_cmpge_epi32_mask(feature, _mm512_setzero_si512());
+                if (!is_split) continue;
+
+                feature         = _mm512_max_epi32(feature, _mm512_setzero_si512());
+                __m512 x        = _mm512_i32gather_ps(_mm512_add_epi32(row_offset[v], feature), base, 4);
+                __m512 value    = _mm512_i32gather_ps(idx[v], split_value, 4);
+                __m512i left    = _mm512_i32gather_epi32(idx[v], left_child, 4);
+                __mmask16 right = _mm512_cmp_ps_mask(x, value, _CMP_NLT_UQ);
+                __m512i next    = _mm512_mask_add_epi32(left, right, left, one);
+
+                idx[v]   = _mm512_mask_mov_epi32(idx[v], is_split, next);
+                active |= is_split;
+            }
+        }
+
+        for (int v = 0; v < VECS; v++) {
+            __m512 leaf     = _mm512_i32gather_ps(idx[v], split_value, 4);
+            __m256 high     = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(leaf), 1));
+            path[2 * v]     = _mm512_add_pd(path[2 * v], _mm512_cvtps_pd(_mm512_castps512_ps256(leaf)));
+            path[2 * v + 1] = _mm512_add_pd(path[2 * v + 1], _mm512_cvtps_pd(high));
+        }
+    }
+
+    for (int v = 0; v < VECS; v++) {
+        double total[LANES];
+        _mm512_storeu_pd(total, path[2 * v]);
+        _mm512_storeu_pd(total + 8, path[2 * v + 1]);
+        for (int l = 0; l < LANES; l++) {
+            out[v * LANES + l] = path_to_score(total[l], model);
+        }
+    }
+}
+#endif
+
+static score_tile_d_fn score_tile_d_impl     = score_tile_d;
+static score_tile_f_fn score_tile_f_impl     = score_tile_f;
+static score_tile_d_fn score_tile_ext_d_impl = score_tile_ext_d;
+static score_tile_f_fn score_tile_ext_f_impl = score_tile_ext_f;
+static pthread_once_t score_tile_once        = PTHREAD_ONCE_INIT;
+
+// Pick the traversal kernels for this host. AVX2 is the default, the AVX-512
+// kernels measured slower than AVX2 on gather-bound traversal, so they are only
+// used when asked for. IFOREST_SIMD=scalar|avx2|avx512 overrides the choice.
+// Extended models have no AVX-512 kernels and use the AVX2 ones for either request.
+static void score_tile_dispatch(void)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+    const char* simd = getenv("IFOREST_SIMD");
+    int want_avx512  = (simd != NULL && strcmp(simd, "avx512") == 0);
+    int want_avx2    = (simd == NULL || want_avx512 || strcmp(simd, "avx2") == 0);
+
+    __builtin_cpu_init();
+    if (want_avx512 && __builtin_cpu_supports("avx512f")) {
+        score_tile_d_impl = score_tile_d_avx512;
+        score_tile_f_impl = score_tile_f_avx512;
+    } else if (want_avx2 && __builtin_cpu_supports("avx2")) {
+        score_tile_d_impl = score_tile_d_avx2;
+        score_tile_f_impl = score_tile_f_avx2;
+    }
+    if (want_avx2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        score_tile_ext_d_impl = score_tile_ext_d_avx2;
+        score_tile_ext_f_impl = score_tile_ext_f_avx2;
+    }
+#endif
+}
+
+// Quantized counterpart of score_rows: a tile of rows is binned into bins, then
+// every tree is walked for the whole tile before the next one
+static void score_rows_q(const score_ctx* ctx, uint16_t* bins, uint64_t start_row, uint64_t end_row)
+{
+    const ndarray_t* data      = ctx->data;
+    const iforest_model* model = ctx->model;
+    int n_features             = model->num_features;
+
+    for (uint64_t i = start_row; i < end_row; i += SCORE_TILE) {
+        int n                = (end_row - i < SCORE_TILE) ? (int)(end_row - i) : SCORE_TILE;
+        const uint8_t* point = (const uint8_t*)data->data + i * data->strides[0];
+        for (int r = 0; r < n; r++) {
+            for (int j = 0; j < n_features; j++) {
+                const uint8_t* cell      = point + r * data->strides[0] + j * data->strides[1];
+                double value             = (data->dtype == 'd') ? *(const double*)cell : *(const float*)cell;
+                bins[r * n_features + j] = quant_bin(model, j, value);
+            }
+        }
+
+        if (ctx->labels) {
+            for (int r = 0; r < n; r++) {
+                point_row row = {NULL, 0, bins + r * n_features};
+                int evaluated;
+                ctx->labels[i + r] = predict_point(model, ctx->bounds, &ctx->cutoff, point_path_q, &row, &evaluated);
+            }
+            continue;
+        }
+        double path[SCORE_TILE] = {0};
+        for (int t = 0; t < model->num_trees; t++) {
+            for (int r = 0; r < n; r++) {
+                path[r] += itree_get_path_len_q(model, t, bins + r * n_features);
+            }
+        }
+        for (int r = 0; r < n; r++) {
+            ctx->out[i + r] = path_to_score(path[r], model);
+        }
+    }
+}
+
+// Scores rows [start_row, end_row) in tiles. Rows already in the model's dtype are
+// read in place, anything else is converted into the scratch tile of the model's dtype.
+static void score_rows(const score_ctx* ctx, void* tile, uint64_t start_row, uint64_t end_row)
+{
+    const ndarray_t* data      = ctx->data;
+    const iforest_model* model = ctx->model;
+    uint64_t n_features        = data->dimensions[1];
+    size_t type_size           = (model->dtype == 'f') ? sizeof(float) : sizeof(double);
+    if (model->qwidth) {
+        score_rows_q(ctx, tile, start_row, end_row);
+        return;
+    }
+
+    for (uint64_t i = start_row; i < end_row; i += SCORE_TILE) {
+        int n                = (end_row - i < SCORE_TILE) ? (int)(end_row - i) : SCORE_TILE;
+        const uint8_t* point = (const uint8_t*)data->data + i * data->strides[0];
+        const void* base     = point;
+        int64_t stride       = data->strides[0] / type_size;
+        if (tile) {
+            for (int r = 0; r < n; r++) {
+                for (uint64_t j = 0; j < n_features; j++) {
+                    const uint8_t* cell = point + r * data->strides[0] + j * data->strides[1];
+                    double value        = (data->dtype == 'd') ? *(const double*)cell : *(const float*)cell;
+                    if (model->dtype == 'f') {
+                        ((float*)tile)[r * n_features + j] = (float)value;
+                    } else {
+                        ((double*)tile)[r * n_features + j] = value;
+                    }
+                }
+            }
+            base   = tile;
+            stride = n_features;
+        }
+        if (ctx->labels) {
+            size_t row_bytes   = stride * type_size;
+            point_path_fn path = point_path(model, model->dtype);
+            for (int r = 0; r < n; r++) {
+                point_row row = {(const uint8_t*)base + r * row_bytes, model->dtype, NULL};
+                int evaluated;
+                ctx->labels[i + r] = predict_point(model, ctx->bounds, &ctx->cutoff, path, &row, &evaluated);
+            }
+        } else if (model->dtype == 'f') {
+            (model->ext_k ? score_tile_ext_f_impl : score_tile_f_impl)(model, base, stride, n, ctx->out + i);
+        } else {
+            (model->ext_k ? score_tile_ext_d_impl : score_tile_d_impl)(model, base, stride, n, ctx->out + i);
+        }
+    }
+}
+
+static void score_rows_worker(void* arg, int worker)
+{
+    (void)worker;
+    score_ctx* ctx             = (score_ctx*)arg;
+    const ndarray_t* data      = ctx->data;
+    const iforest_model* model = ctx->model;
+    uint64_t n_rows            = data->dimensions[0];
+    size_t type_size           = (model->dtype == 'f') ? sizeof(float) : sizeof(double);
+    int contiguous             = (data->dtype == model->dtype && data->strides[1] == type_size && data->strides[0] % type_size == 0);
+    void* tile                 = NULL;
+
+    // Quantized models always bin rows into the tile
+    if (model->qwidth || !contiguous) {
+        tile = malloc(SCORE_TILE * data->dimensions[1] * (model->qwidth ? sizeof(uint16_t) : type_size));
+        if (tile == NULL) {
+            printf("Memory allocation failed.\n");
+            return;
+        }
+    }
+
+    for (;;) {
+        uint64_t start = atomic_fetch_add(&ctx->next_row, SCORE_BLOCK_ROWS);
+        if (start >= n_rows) break;
+        uint64_t end = (n_rows - start < SCORE_BLOCK_ROWS) ? n_rows : start + SCORE_BLOCK_ROWS;
+        score_rows(ctx, tile, start, end);
+    }
+    free(tile);
+}
+
+// Run a prepared job over all rows of ctx->data. The pool is only used when
+// use_pool is set, the batch spans several blocks and no other call holds it.
+static void score_run(score_ctx* ctx, int use_pool)
+{
+    atomic_init(&ctx->next_row, 0);
+    pthread_once(&score_tile_once, score_tile_dispatch);
+    if (!use_pool || ctx->data->dimensions[0] <= SCORE_BLOCK_ROWS ||
+        thread_pool_try_run(ctx->forest->pool, score_rows_worker, ctx) != 0) {
+        score_rows_worker(ctx, 0);
+    }
+}
+
+// k-th smallest of v[0, n), v is reordered so nothing after k is smaller
+static double select_kth(double* v, int64_t n, int64_t k)
+{
+    int64_t lo = 0;
+    int64_t hi = n - 1;
+    while (lo < hi) {
+        double pivot = v[lo + (hi - lo) / 2];
+        int64_t i    = lo;
+        int64_t j    = hi;
+        while (i <= j) {
+            while (v[i] < pivot) i++;
+            while (v[j] > pivot) j--;
+            if (i <= j) {
+                double swap = v[i];
+                v[i++]      = v[j];
+                v[j--]      = swap;
+            }
+        }
+        // [lo, j] is at most pivot, [i, hi] at least pivot, anything between equals it
+        if (k <= j) {
+            hi = j;
+        } else if (k >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+    return v[k];
+}
+
+// Score threshold for forest->contamination over the rows of X: the (1 - contamination)
+// quantile of their scores, interpolated like numpy.percentile. Contamination 0 means
+// "auto", the fixed threshold of 0.5 from the original paper.
+static double fit_threshold(isolation_forest* forest, const iforest_model* model, const ndarray_t* X, int use_pool)
+{
+    double contamination = forest->contamination;
+    int64_t n            = X->dimensions[0];
+    if (!(contamination > 0 && contamination <= 0.5) || n == 0) {
+        return 0.5;
+    }
+
+    double* scores = malloc(n * sizeof(double));
+    if (scores == NULL) {
+        printf("Memory allocation failed.\n");
+        return 0.5;
+    }
+    score_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.forest = forest;
+    ctx.model  = model;
+    ctx.data   = X;
+    ctx.out    = scores;
+    score_run(&ctx, use_pool);
+
+    // Two order statistics by selection instead of a full sort
+    double pos  = (1 - contamination) * (n - 1);
+    int64_t k   = (int64_t)pos;
+    double low  = select_kth(scores, n, k);
+    double high = low;
+    for (int64_t i = k + 1; i < n; i++) {
+        if (i == k + 1 || scores[i] < high) high = scores[i];
+    }
+    free(scores);
+    return low + (pos - k) * (high - low);
+}
+
+int iforest_score_batch(isolation_forest* forest, const ndarray_t* X, double* out)
+{
+    if (forest == NULL || X == NULL || out == NULL || X->nd != 2 || (X->dtype != 'd' && X->dtype != 'f')) {
+        return -1;
+    }
+
+    // Every row is scored against the same snapshot, even if a new model is published meanwhile
+    atomic_long* pin;
+    const iforest_model* model = model_acquire(forest, &pin);
+    if (model == NULL || X->dimensions[1] != (uint64_t)model->num_features) {
+        model_release(pin);
+        return -1;
+    }
+
+    score_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.forest = forest;
+    ctx.model  = model;
+    ctx.data   = X;
+    ctx.out    = out;
+    score_run(&ctx, 1);
+    model_release(pin);
+    return 0;
+}
+
+double iforest_threshold(isolation_forest* forest)
+{
+    atomic_long* pin;
+    const iforest_model* model = model_acquire(forest, &pin);
+    double threshold           = model ? model->threshold : NAN;
+    model_release(pin);
+    return threshold;
+}
+
+int iforest_predict_batch(isolation_forest* forest, const ndarray_t* X, int* labels)
+{
+    if (forest == NULL || X == NULL || labels == NULL || X->nd != 2 || (X->dtype != 'd' && X->dtype != 'f')) {
+        return -1;
+    }
+
+    // Rows are labeled with early termination against the snapshot's own threshold
+    atomic_long* pin;
+    iforest_model* model  = (iforest_model*)model_acquire(forest, &pin);
+    const double* bounds = model ? model_path_bounds(model) : NULL;
+    if (bounds == NULL || X->dimensions[1] != (uint64_t)model->num_features) {
+        model_release(pin);
+        return -1;
+    }
+
+    score_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.forest = forest;
+    ctx.model  = model;
+    ctx.data   = X;
+    ctx.labels = labels;
+    ctx.bounds = bounds;
+    ctx.cutoff = predict_cutoff(model, bounds, model->threshold);
+    score_run(&ctx, 1);
+    model_release(pin);
+    return 0;
+}
+
+// Model file: a fixed header followed by the model block exactly as it sits in
+// memory. Array offsets are relative to the block, so a mapping of the file can
+// be scored in place wherever it lands in the address space.
+#define IFOREST_MAGIC          "IFOREST"
+#define IFOREST_FORMAT_VERSION 5
+#define IFOREST_BYTE_ORDER     0x01020304u
+
+typedef struct {
+    char magic[8];            // IFOREST_MAGIC
+    uint32_t version;         // IFOREST_FORMAT_VERSION
+    uint32_t byte_order;      // IFOREST_BYTE_ORDER as stored by the saving host
+    uint64_t header_size;     // Model block offset in the file, MODEL_ALIGN aligned
+    uint64_t block_size;      // Model block length
+    int32_t num_trees;        // Forest parameters, see iforest_init
+    int32_t num_samples;
+    int32_t max_depth;
+    int32_t num_threads;
+    int32_t num_features;     // Row width the model was trained on
+    int32_t num_nodes;        // Total nodes over all trees
+    uint32_t random_state;
+    char dtype;               // Threshold type, 'd' or 'f'
+    char reserved[3];
+    double contamination;
+    uint64_t split_value;     // Array offsets inside the model block
+    uint64_t tree_offset;
+    uint64_t split_feature;
+    uint64_t left_child;
+    uint64_t sample_size;
+    double threshold;         // Fitted score threshold, see iforest_threshold
+    int32_t ext_k;            // Nonzeros per hyperplane normal, 0 for axis-parallel splits
+    int32_t reserved2;
+    uint64_t normal_feature;  // Extended models only, empty otherwise
+    uint64_t normal_weight;
+    int32_t qwidth;           // Quantized models, see iforest_quantize
+    int32_t num_edges;
+    double leaf_scale;
+    double path_scale;        // Sum of c(subsample size) over trees
+    uint64_t bin_offset;      // Quantized models only, empty otherwise
+    uint64_t bin_edges;
+    uint64_t qfeature;
+    uint64_t qcode;
+    uint64_t qchild;
+} iforest_file_header;
+
+// Model counts and kinds described by header, enough for model_get_layout
+static void header_shape(const iforest_file_header* header, iforest_model* shape)
+{
+    shape->num_trees    = header->num_trees;
+    shape->num_nodes    = header->num_nodes;
+    shape->num_features = header->num_features;
+    shape->dtype        = header->dtype;
+    shape->ext_k        = header->ext_k;
+    shape->qwidth       = header->qwidth;
+    shape->num_edges    = header->num_edges;
+}
+
+// Write size bytes and zero fill up to padded_size, padding is below MODEL_ALIGN.
+// Arrays a model does not use are empty and may be NULL.
+static int write_padded(FILE* file, const void* data, size_t size, size_t padded_size)
+{
+    static const uint8_t padding[MODEL_ALIGN] = {0};
+    if (size > 0 && fwrite(data, 1, size, file) != size) {
+        return 0;
+    }
+    return fwrite(padding, 1, padded_size - size, file) == padded_size - size;
+}
+
+int iforest_save(isolation_forest* forest, const char* path)
+{
+    atomic_long* pin;
+    const iforest_model* model = model_acquire(forest, &pin);
+    if (model == NULL) {
+        model_release(pin);
+        return -1;
+    }
+
+    model_layout layout;
+    model_get_layout(model, &layout);
+
+    iforest_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IFOREST_MAGIC, sizeof(IFOREST_MAGIC));
+    header.version        = IFOREST_FORMAT_VERSION;
+    header.byte_order     = IFOREST_BYTE_ORDER;
+    header.header_size    = ALIGN_UP(sizeof(header));
+    header.block_size     = layout.size;
+    header.num_trees      = model->num_trees;
+    header.num_samples    = forest->num_samples;
+    header.max_depth      = forest->max_depth;
+    header.num_threads    = forest->num_threads;
+    header.num_features   = model->num_features;
+    header.num_nodes      = model->num_nodes;
+    header.random_state   = forest->random_state;
+    header.dtype          = model->dtype;
+    header.contamination  = forest->contamination;
+    header.split_value    = layout.split_value;
+    header.tree_offset    = layout.tree_offset;
+    header.split_feature  = layout.split_feature;
+    header.left_child     = layout.left_child;
+    header.sample_size    = layout.sample_size;
+    header.threshold      = model->threshold;
+    header.ext_k          = model->ext_k;
+    header.normal_feature = layout.normal_feature;
+    header.normal_weight  = layout.normal_weight;
+    header.qwidth         = model->qwidth;
+    header.num_edges      = model->num_edges;
+    header.leaf_scale     = model->leaf_scale;
+    header.path_scale     = model->path_scale;
+    header.bin_offset     = layout.bin_offset;
+    header.bin_edges      = layout.bin_edges;
+    header.qfeature       = layout.qfeature;
+    header.qcode          = layout.qcode;
+    header.qchild         = layout.qchild;
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        perror("Failed to open file");
+        model_release(pin);
+        return -1;
+    }
+
+    // Arrays are written from the live pointers, so a mapped model saves the same way.
+    // Arrays a model does not have are empty in its layout.
+    size_t value_size   = (model->dtype == 'f') ? sizeof(float) : sizeof(double);
+    size_t full_nodes   = model->qwidth ? 0 : model->num_nodes;
+    size_t quant_nodes  = model->qwidth ? model->num_nodes : 0;
+    size_t node_ints    = full_nodes * sizeof(int32_t);
+    size_t normal_count = full_nodes * model->ext_k;
+    size_t bin_offsets  = model->qwidth ? (model->num_features + 1) * sizeof(int32_t) : 0;
+    int ok              = write_padded(file, &header, sizeof(header), header.header_size) &&
+             write_padded(file, model->split_value, full_nodes * value_size, layout.tree_offset - layout.split_value) &&
+             write_padded(file, model->tree_offset, (model->num_trees + 1) * sizeof(int32_t), layout.split_feature - layout.tree_offset) &&
+             write_padded(file, model->split_feature, node_ints, layout.left_child - layout.split_feature) &&
+             write_padded(file, model->left_child, node_ints, layout.sample_size - layout.left_child) &&
+             write_padded(file, model->sample_size, node_ints, layout.normal_feature - layout.sample_size) &&
+             write_padded(file, model->normal_feature, normal_count * sizeof(int32_t), layout.normal_weight - layout.normal_feature) &&
+             write_padded(file, model->normal_weight, normal_count * value_size, layout.bin_offset - layout.normal_weight) &&
+             write_padded(file, model->bin_offset, bin_offsets, layout.bin_edges - layout.bin_offset) &&
+             write_padded(file, model->bin_edges, model->num_edges * sizeof(double), layout.qfeature - layout.bin_edges) &&
+             write_padded(file, model->qfeature, quant_nodes * model->qwidth, layout.qcode - layout.qfeature) &&
+             write_padded(file, model->qcode, quant_nodes * model->qwidth, layout.qchild - layout.qcode) &&
+             write_padded(file, model->qchild, quant_nodes * sizeof(uint16_t), layout.size - layout.qchild);
+
+    if (fclose(file) != 0) ok = 0;
+    model_release(pin);
+    return ok ? 0 : -1;
+}
+
+// Header must describe exactly the layout this build would produce for its counts
+static int check_header(const iforest_file_header* header, uint64_t file_size)
+{
+    if (memcmp(header->magic, IFOREST_MAGIC, sizeof(IFOREST_MAGIC)) != 0 ||
+        header->version != IFOREST_FORMAT_VERSION || header->byte_order != IFOREST_BYTE_ORDER) {
+        return -1;
+    }
+    if ((header->dtype != 'd' && header->dtype != 'f') || header->num_trees <= 0 ||
+        header->num_nodes < header->num_trees || header->num_features <= 0 || header->num_samples <= 0 ||
+        header->ext_k < 0 || header->ext_k == 1 || header->ext_k > header->num_features) {
+        return -1;
+    }
+    if (header->qwidth < 0 || header->qwidth > 2 || header->num_edges < 0 || (!header->qwidth && header->num_edges != 0) ||
+        (header->qwidth && (header->ext_k != 0 || header->num_features > (header->qwidth == 1 ? 0xFF : 0xFFFF)))) {
+        return -1;
+    }
+    if (header->header_size < sizeof(*header) || header->header_size % MODEL_ALIGN != 0 ||
+        header->header_size + header->block_size > file_size) {
+        return -1;
+    }
+
+    iforest_model shape;
+    model_layout layout;
+    header_shape(header, &shape);
+    model_get_layout(&shape, &layout);
+    if (layout.size != header->block_size || layout.split_value != header->split_value ||
+        layout.tree_offset != header->tree_offset || layout.split_feature != header->split_feature ||
+        layout.left_child != header->left_child || layout.sample_size != header->sample_size ||
+        layout.normal_feature != header->normal_feature || layout.normal_weight != header->normal_weight ||
+        layout.bin_offset != header->bin_offset || layout.bin_edges != header->bin_edges ||
+        layout.qfeature != header->qfeature || layout.qcode != header->qcode || layout.qchild != header->qchild) {
+        return -1;
+    }
+    return 0;
+}
+
+// Tree slices must tile the node arrays, checked in O(num_trees)
+static int check_tree_offsets(const iforest_model* model)
+{
+    if (model->tree_offset[0] != 0 || model->tree_offset[model->num_trees] != model->num_nodes) {
+        return -1;
+    }
+    for (int i = 0; i < model->num_trees; i++) {
+        if (model->tree_offset[i + 1] <= model->tree_offset[i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Feature edge ranges must tile the edge array, checked in O(num_features)
+static int check_bin_offsets(const iforest_model* model)
+{
+    if (!model->qwidth) {
+        return 0;
+    }
+    if (model->bin_offset[0] != 0 || model->bin_offset[model->num_features] != model->num_edges) {
+        return -1;
+    }
+    for (int j = 0; j < model->num_features; j++) {
+        if (model->bin_offset[j + 1] < model->bin_offset[j]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Every child must stay inside its tree and every feature inside the row
+static int check_nodes(const iforest_model* model)
+{
+    for (int t = 0; t < model->num_trees; t++) {
+        int32_t offset = model->tree_offset[t];
+        int32_t size   = model->tree_offset[t + 1] - offset;
+        for (int32_t i = 0; i < size && model->qwidth; i++) {
+            int32_t feature = quant_load(model->qfeature, model->qwidth, offset + i);
+            if (feature == QUANT_LEAF(model->qwidth)) continue;
+            int32_t left = model->qchild[offset + i];
+            if (feature >= model->num_features || left <= i || left + 1 >= size) {
+                return -1;
+            }
+        }
+        for (int32_t i = 0; i < size && !model->qwidth; i++) {
+            int32_t feature = model->split_feature[offset + i];
+            if (feature == -1) continue;
+            int32_t left = model->left_child[offset + i];
+            if (feature < 0 || feature >= model->num_features || left <= i || left + 1 >= size) {
+                return -1;
+            }
+            for (int j = 0; j < model->ext_k; j++) {
+                int32_t normal = model->normal_feature[(size_t)(offset + i) * model->ext_k + j];
+                if (normal < 0 || normal >= model->num_features) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static isolation_forest* forest_from_header(const iforest_file_header* header, iforest_model* model)
+{
+    isolation_forest* forest = iforest_init(header->num_trees, header->num_samples, header->num_features,
+                                            header->num_threads, header->contamination, header->random_state);
+    if (forest == NULL) {
+        model_free(model);
+        return NULL;
+    }
+    forest->max_depth       = header->max_depth;
+    forest->extension_level = header->ext_k ? header->ext_k - 1 : 0;
+    model->threshold        = header->threshold;
+    model->path_scale       = header->path_scale;
+    model->leaf_scale       = header->leaf_scale;
+    atomic_store(&forest->model, model);
+    return forest;
+}
+
+isolation_forest* iforest_load(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        perror("Failed to open file");
+        return NULL;
+    }
+
+    struct stat st;
+    iforest_file_header header;
+    if (fstat(fileno(file), &st) != 0 || fread(&header, sizeof(header), 1, file) != 1 ||
+        check_header(&header, st.st_size) != 0) {
+        printf("Invalid model file: %s\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    iforest_model shape;
+    header_shape(&header, &shape);
+    iforest_model* model = model_alloc(&shape);
+    if (model == NULL) {
+        printf("Memory allocation failed.\n");
+        fclose(file);
+        return NULL;
+    }
+
+    int ok = fseek(file, header.header_size, SEEK_SET) == 0 && fread(model->buffer, header.block_size, 1, file) == 1;
+    fclose(file);
+    if (!ok || check_tree_offsets(model) != 0 || check_bin_offsets(model) != 0 || check_nodes(model) != 0) {
+        printf("Invalid model file: %s\n", path);
+        model_free(model);
+        return NULL;
+    }
+    return forest_from_header(&header, model);
+}
+
+isolation_forest* iforest_load_mmap(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open file");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(iforest_file_header)) {
+        printf("Invalid model file: %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("Failed to map file");
+        return NULL;
+    }
+
+    const iforest_file_header* header = mapping;
+    iforest_model* model              = calloc(1, sizeof(iforest_model));
+    if (model == NULL || check_header(header, st.st_size) != 0) {
+        printf("Invalid model file: %s\n", path);
+        free(model);
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+
+    model_layout layout;
+    header_shape(header, model);
+    model_get_layout(model, &layout);
+    model->mapping      = mapping;
+    model->mapping_size = st.st_size;
+    model_bind(model, (uint8_t*)mapping + header->header_size, &layout);
+
+    // One read-only pass over the mapped nodes, scoring never leaves a tree or a row
+    if (check_tree_offsets(model) != 0 || check_bin_offsets(model) != 0 || check_nodes(model) != 0) {
+        printf("Invalid model file: %s\n", path);
+        model_free(model);
+        return NULL;
     }
-    avg_path /= forest->num_trees;
-    // printf("Average path length: %.6f, num-trees: %d, Cn: %.6f ret: %.6f \n", avg_path, forest->num_trees, C(forest->num_samples), pow(2, -avg_path / C(forest->num_samples)));
-    return pow(2, -avg_path / C(forest->num_samples));
+    return forest_from_header(header, model);
 }
 
 void iforest_free(isolation_forest* forest)
 {
-    for (int i = 0; i < forest->num_trees; i++) {
-        if (forest->trees[i]) free_tree(forest->trees[i]);
+    iforest_stream* stream = atomic_load(&forest->stream);
+    if (stream) {
+        pthread_mutex_lock(&stream->lock);
+        stream->stop = 1;
+        pthread_cond_signal(&stream->wake);
+        pthread_mutex_unlock(&stream->lock);
+        pthread_join(stream->thread, NULL);
+        stream_free(stream);
     }
+    pthread_mutex_destroy(&forest->publish_lock);
+    free(forest->slots);
     free(forest->trees);
+    free(forest->path_table);
+    model_free(atomic_load(&forest->model));
+    thread_pool_free(forest->pool);
     free(forest);
 }
\ No newline at end of file
@@ -27,12 +27,24 @@ THE SOFTWARE.
 
 #include "ndarray.h"
 
+#include <fcntl.h>
+#include <float.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "thread_pool.h"
 
 uint64_t ndarray_size(const ndarray_t* array);
 
@@ -87,43 +99,560 @@ ndarray_t* ndarray_create(uint64_t* dimensions, uint32_t nd, char dtype)
 
 void ndarray_free(ndarray_t* array)
 {
-    free(array->data);
+    if (array->owner == NDARRAY_OWNER_MMAP) {
+        munmap(array->mapping, array->mapping_size);
+    } else if (array->owner == NDARRAY_OWNER_USER) {
+        array->release(array->data);
+    } else if (array->owner == NDARRAY_OWNER_HEAP) {
+        free(array->data);
+    }
     free(array->dimensions);
     free(array->strides);
     free(array);
 }
 
-// Create ndarray from CSV file
+ndarray_t* ndarray_from_buffer(void* data, uint32_t nd, const uint64_t* dimensions, const uint64_t* strides, char dtype,
+                               void (*release)(void*))
+{
+    if (data == NULL || nd == 0 || (dtype != 'd' && dtype != 'f' && dtype != 'i')) {
+        return NULL;
+    }
+
+    ndarray_t* array  = calloc(1, sizeof(ndarray_t));
+    uint64_t* shape   = malloc(nd * sizeof(uint64_t));
+    uint64_t* steps   = malloc(nd * sizeof(uint64_t));
+    if (!array || !shape || !steps) {
+        printf("Memory allocation failed.\n");
+        free(array);
+        free(shape);
+        free(steps);
+        return NULL;
+    }
+    memcpy(shape, dimensions, nd * sizeof(uint64_t));
+    if (strides) {
+        memcpy(steps, strides, nd * sizeof(uint64_t));
+    } else {
+        steps[nd - 1] = calculate_type_size(dtype);
+        for (int i = nd - 2; i >= 0; i--) {
+            steps[i] = steps[i + 1] * shape[i + 1];
+        }
+    }
+    array->data       = data;
+    array->dimensions = shape;
+    array->strides    = steps;
+    array->nd         = nd;
+    array->dtype      = dtype;
+    array->owner      = release ? NDARRAY_OWNER_USER : NDARRAY_OWNER_NONE;
+    array->release    = release;
+    return array;
+}
+
+// One pool over the online cores for CSV parsing and matrix products, created by the first
+// call large enough to use it and kept for the life of the process. NULL on a single core.
+static thread_pool* shared_pool        = NULL;
+static pthread_once_t shared_pool_once = PTHREAD_ONCE_INIT;
+
+static void shared_pool_create(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 1) shared_pool = thread_pool_create((int)cores);
+}
+
+static thread_pool* get_shared_pool(void)
+{
+    pthread_once(&shared_pool_once, shared_pool_create);
+    return shared_pool;
+}
+
+// Run fn on pool, or on the calling thread alone when there is no pool or another call
+// holds it
+static void shared_pool_run(thread_pool* pool, thread_pool_fn fn, void* arg)
+{
+    if (pool == NULL || thread_pool_try_run(pool, fn, arg) != 0) {
+        fn(arg, 0);
+    }
+}
+
+// CSV parsing: fields are separated by commas, blank lines are skipped and lines may end
+// in "\r\n". The file is mapped and cut into chunks at line starts, workers count the
+// rows of each chunk and then parse them straight into place.
+#define CSV_CHUNK_BYTES ((size_t)1 << 20)
+#define CSV_FIELD_CHARS 64
+
+typedef struct {
+    const char** bounds;    // num_chunks + 1 chunk limits, each at the start of a line
+    uint64_t* first_row;    // Row of each chunk's first line, the row count at num_chunks
+    int num_chunks;
+    atomic_int next_chunk;  // Next chunk to hand out
+    uint64_t n_features;
+    ndarray_t* array;       // NULL while rows are counted
+    atomic_ullong bad_row;  // Lowest row that failed to parse, from 0, UINT64_MAX if none
+} csv_ctx;
+
+static const double csv_pow10[23] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+#if LDBL_MANT_DIG == 64
+static const long double csv_pow10l[28] = {1e0L,  1e1L,  1e2L,  1e3L,  1e4L,  1e5L,  1e6L,  1e7L,  1e8L,  1e9L,
+                                           1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+                                           1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L};
+#endif
+
+static inline int csv_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Parse the number filling [p, end). Up to 19 significant digits with a power of ten
+// within 1e22 give an exact mantissa and power, so one IEEE multiply or divide rounds
+// the same as strtod. Anything else, such as longer mantissas or "nan", uses strtod.
+// An empty field is NaN. Returns 0 on success, -1 if the field is not a number.
+static int csv_parse_double(const char* p, const char* end, double* out)
+{
+    while (p < end && csv_is_space(*p)) p++;
+    while (end > p && csv_is_space(end[-1])) end--;
+    if (p == end) {
+        *out = NAN;
+        return 0;
+    }
+
+    const char* s    = p;
+    int negative     = (*p == '-');
+    uint64_t mant    = 0;
+    int digits       = 0;
+    int exact        = 1;
+    int any          = 0;
+    int64_t exponent = 0;
+    if (*p == '-' || *p == '+') p++;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, any = 1) {
+        if (digits < 19) {
+            mant = mant * 10 + (*p - '0');
+            digits += (mant != 0);
+        } else {
+            exponent++;
+            exact &= (*p == '0');
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = 1) {
+            if (digits < 19) {
+                mant = mant * 10 + (*p - '0');
+                digits += (mant != 0);
+                exponent--;
+            } else {
+                exact &= (*p == '0');
+            }
+        }
+    }
+    if (any && p < end && (*p == 'e' || *p == 'E')) {
+        const char* e = p + 1;
+        int e_negative = (e < end && *e == '-');
+        int64_t value  = 0;
+        if (e < end && (*e == '-' || *e == '+')) e++;
+        if (e < end && *e >= '0' && *e <= '9') {
+            for (; e < end && *e >= '0' && *e <= '9'; e++) {
+                if (value < 100000) value = value * 10 + (*e - '0');
+            }
+            exponent += e_negative ? -value : value;
+            p = e;
+        }
+    }
+
+    if (any && p == end && exact && mant <= ((uint64_t)1 << 53) && exponent >= -22 && exponent <= 22) {
+        double value = (double)mant;
+        value        = (exponent < 0) ? value / csv_pow10[-exponent] : value * csv_pow10[exponent];
+        *out         = negative ? -value : value;
+        return 0;
+    }
+
+#if LDBL_MANT_DIG == 64
+    // All 19 digits and powers up to 1e27 are exact in x87 long double. Its one rounding
+    // can only flip the rounding to double when the result lands next to a halfway point.
+    if (any && p == end && exact && exponent >= -27 && exponent <= 27) {
+        long double value = (long double)mant;
+        value             = (exponent < 0) ? value / csv_pow10l[-exponent] : value * csv_pow10l[exponent];
+        int binary_exponent;
+        uint64_t bits = (uint64_t)ldexpl(frexpl(value, &binary_exponent), 64);
+        uint64_t low  = bits & 0x7FF;
+        if ((low < 0x3FF || low > 0x401) && value >= DBL_MIN && value <= DBL_MAX) {
+            *out = negative ? -(double)value : (double)value;
+            return 0;
+        }
+    }
+#endif
+
+    // strtod needs a terminated copy, the mapping may end right after the field. Fields
+    // too long for the stack copy, such as exact decimal expansions, go to the heap.
+    char buffer[CSV_FIELD_CHARS];
+    size_t length = (size_t)(end - s);
+    char* field   = (length < CSV_FIELD_CHARS) ? buffer : malloc(length + 1);
+    if (field == NULL) {
+        printf("Memory allocation failed.\n");
+        return -1;
+    }
+    memcpy(field, s, length);
+    field[length] = '\0';
+    char* stop;
+    *out       = strtod(field, &stop);
+    int status = (*stop == '\0') ? 0 : -1;
+    if (field != buffer) free(field);
+    return status;
+}
+
+// Number of fields of the line [p, end)
+static uint64_t csv_count_fields(const char* p, const char* end)
+{
+    uint64_t fields = 1;
+    for (; p < end; p++) {
+        fields += (*p == ',');
+    }
+    return fields;
+}
+
+// Parse the fields of line [p, end) into row, returns -1 on a bad field or field count
+static int csv_parse_line(const char* p, const char* end, uint64_t n_features, char dtype, void* row)
+{
+    for (uint64_t j = 0; j < n_features; j++) {
+        const char* comma = memchr(p, ',', end - p);
+        const char* stop  = comma ? comma : end;
+        if ((comma == NULL) != (j == n_features - 1)) {
+            return -1;
+        }
+        double value;
+        if (csv_parse_double(p, stop, &value) != 0) {
+            return -1;
+        }
+        if (dtype == 'f') {
+            ((float*)row)[j] = (float)value;
+        } else {
+            ((double*)row)[j] = value;
+        }
+        p = stop + 1;
+    }
+    return 0;
+}
+
+static inline int csv_is_blank(const char* p, const char* end)
+{
+    while (p < end && csv_is_space(*p)) p++;
+    return p == end;
+}
+
+static void csv_worker(void* arg, int worker)
+{
+    (void)worker;
+    csv_ctx* ctx = (csv_ctx*)arg;
+    for (int c = atomic_fetch_add(&ctx->next_chunk, 1); c < ctx->num_chunks; c = atomic_fetch_add(&ctx->next_chunk, 1)) {
+        const char* p   = ctx->bounds[c];
+        const char* end = ctx->bounds[c + 1];
+        uint64_t row    = ctx->array ? ctx->first_row[c] : 0;
+        while (p < end) {
+            const char* newline = memchr(p, '\n', end - p);
+            const char* stop    = newline ? newline : end;
+            if (!csv_is_blank(p, stop)) {
+                if (ctx->array) {
+                    void* dst = (uint8_t*)ctx->array->data + row * ctx->array->strides[0];
+                    if (csv_parse_line(p, stop, ctx->n_features, ctx->array->dtype, dst) != 0) {
+                        // Keep the first bad row for the error message
+                        unsigned long long bad = atomic_load(&ctx->bad_row);
+                        while (row < bad && !atomic_compare_exchange_weak(&ctx->bad_row, &bad, row)) {
+                        }
+                    }
+                }
+                row++;
+            }
+            p = stop + 1;
+        }
+        if (!ctx->array) ctx->first_row[c + 1] = row;
+    }
+}
+
+// Parse the rows in [data, end) on the shared pool, the chunks are counted first so
+// every worker knows where its rows go. Files of one chunk are parsed on the caller.
+static ndarray_t* csv_parse(const char* filename, const char* data, const char* end, uint64_t n_features, char dtype)
+{
+    size_t bytes   = end - data;
+    int num_chunks = (int)((bytes + CSV_CHUNK_BYTES - 1) / CSV_CHUNK_BYTES);
+    num_chunks     = (num_chunks > 0) ? num_chunks : 1;
+
+    csv_ctx ctx;
+    ctx.num_chunks    = num_chunks;
+    ctx.n_features    = n_features;
+    ctx.array         = NULL;
+    ctx.bounds        = malloc((num_chunks + 1) * sizeof(const char*));
+    ctx.first_row     = calloc(num_chunks + 1, sizeof(uint64_t));
+    thread_pool* pool = (num_chunks > 1) ? get_shared_pool() : NULL;
+    if (ctx.bounds == NULL || ctx.first_row == NULL) {
+        printf("Memory allocation failed.\n");
+        free(ctx.bounds);
+        free(ctx.first_row);
+        return NULL;
+    }
+
+    // Chunks of about CSV_CHUNK_BYTES, moved forward to the next line start
+    ctx.bounds[0]          = data;
+    ctx.bounds[num_chunks] = end;
+    for (int c = 1; c < num_chunks; c++) {
+        const char* p   = data + (size_t)c * CSV_CHUNK_BYTES;
+        p               = (p < ctx.bounds[c - 1]) ? ctx.bounds[c - 1] : p;
+        const char* eol = memchr(p, '\n', end - p);
+        ctx.bounds[c]   = eol ? eol + 1 : end;
+    }
+    atomic_init(&ctx.next_chunk, 0);
+    atomic_init(&ctx.bad_row, UINT64_MAX);
+    shared_pool_run(pool, csv_worker, &ctx);
+    for (int c = 0; c < num_chunks; c++) {
+        ctx.first_row[c + 1] += ctx.first_row[c];
+    }
+
+    uint64_t dim[2]  = {ctx.first_row[num_chunks], n_features};
+    ndarray_t* array = ndarray_create(dim, 2, dtype);
+    if (array == NULL || (array->data == NULL && dim[0] * dim[1] > 0)) {
+        printf("Memory allocation failed.\n");
+        if (array) ndarray_free(array);
+        array = NULL;
+    } else {
+        ctx.array = array;
+        atomic_store(&ctx.next_chunk, 0);
+        shared_pool_run(pool, csv_worker, &ctx);
+    }
+    if (array && atomic_load(&ctx.bad_row) != UINT64_MAX) {
+        printf("CSV row %llu of %s is not %llu numbers.\n", (unsigned long long)atomic_load(&ctx.bad_row) + 1, filename,
+               (unsigned long long)n_features);
+        ndarray_free(array);
+        array = NULL;
+    }
+
+    free(ctx.bounds);
+    free(ctx.first_row);
+    return array;
+}
+
+// Create ndarray from CSV file. The shape is inferred from the file: one row per non-blank
+// line and one column per field of the first line. That first line is skipped as a header
+// if any of its fields is not a number.
 ndarray_t* ndarray_from_csv(const char* filename, char dtype)
 {
-    FILE* file = fopen(filename, "r");
+    if (dtype != 'd' && dtype != 'f') {
+        printf("CSV data must be read as dtype 'd' or 'f'.\n");
+        return NULL;
+    }
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open file");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    const char* text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        perror("Failed to map file");
+        return NULL;
+    }
+    madvise((void*)text, st.st_size, MADV_SEQUENTIAL);
+    const char* end = text + st.st_size;
+
+    // First non-blank line: its fields give the width, and it is a header unless all parse
+    const char* first = text;
+    const char* stop  = end;
+    for (;;) {
+        const char* newline = memchr(first, '\n', end - first);
+        stop                = newline ? newline : end;
+        if (!csv_is_blank(first, stop) || stop == end) break;
+        first = stop + 1;
+    }
+    uint64_t n_features = csv_count_fields(first, stop);
+    int header          = 0;
+    for (const char* p = first; p < stop && !header;) {
+        const char* comma = memchr(p, ',', stop - p);
+        double value;
+        header = (csv_parse_double(p, comma ? comma : stop, &value) != 0);
+        p      = comma ? comma + 1 : stop;
+    }
+    const char* data = header ? ((stop < end) ? stop + 1 : end) : first;
+
+    ndarray_t* array = csv_parse(filename, data, end, n_features, dtype);
+    munmap((void*)text, st.st_size);
+    return array;
+}
+
+// .npy files: magic, version, little-endian header length, then a Python dict literal
+// padded with spaces and a final newline so the data starts 64-byte aligned
+#define NPY_MAGIC     "\x93NUMPY"
+#define NPY_ALIGN     64
+#define NPY_MAX_DIMS  32
+
+static int npy_host_little_endian(void)
+{
+    uint16_t one = 1;
+    return *(uint8_t*)&one == 1;
+}
+
+int ndarray_save(const ndarray_t* array, const char* filename)
+{
+    const char* descr = (array->dtype == 'd') ? "<f8" : (array->dtype == 'f') ? "<f4" : (array->dtype == 'i') ? "<u8" : NULL;
+    if (descr == NULL || array->nd == 0 || array->nd > NPY_MAX_DIMS || !npy_host_little_endian()) {
+        return -1;
+    }
+
+    // Rows are written as they lie in memory, views in any other order are copied first
+    if (!ndarray_is_contiguous(array)) {
+        ndarray_t* packed = ndarray_copy(array);
+        int status        = packed ? ndarray_save(packed, filename) : -1;
+        if (packed) ndarray_free(packed);
+        return status;
+    }
+
+    char header[NPY_ALIGN * 16];
+    int len = snprintf(header + 10, sizeof(header) - 10, "{'descr': '%s', 'fortran_order': False, 'shape': (", descr);
+    for (uint32_t i = 0; i < array->nd; i++) {
+        len += snprintf(header + 10 + len, sizeof(header) - 10 - len, (array->nd == 1) ? "%llu," : (i + 1 < array->nd) ? "%llu, " : "%llu",
+                        (unsigned long long)array->dimensions[i]);
+    }
+    len += snprintf(header + 10 + len, sizeof(header) - 10 - len, "), }");
+    size_t total = (10 + len + 1 + NPY_ALIGN - 1) / NPY_ALIGN * NPY_ALIGN;
+    memcpy(header, NPY_MAGIC, 6);
+    header[6] = 1;
+    header[7] = 0;
+    header[8] = (char)((total - 10) & 0xFF);
+    header[9] = (char)((total - 10) >> 8);
+    memset(header + 10 + len, ' ', total - 10 - len - 1);
+    header[total - 1] = '\n';
+
+    FILE* file = fopen(filename, "wb");
     if (!file) {
+        perror("Failed to open file");
+        return -1;
+    }
+    size_t bytes = ndarray_size(array) * calculate_type_size(array->dtype);
+    int ok       = fwrite(header, 1, total, file) == total && fwrite(array->data, 1, bytes, file) == bytes;
+    ok           = (fclose(file) == 0) && ok;
+    return ok ? 0 : -1;
+}
+
+// Fill dtype and shape from the header dict text, returns the number of dimensions or -1
+static int npy_parse_header(const char* text, char* dtype, uint64_t* dims)
+{
+    const char* descr   = strstr(text, "'descr'");
+    const char* fortran = strstr(text, "'fortran_order'");
+    const char* shape   = strstr(text, "'shape'");
+    if (descr == NULL || fortran == NULL || shape == NULL) {
+        return -1;
+    }
+
+    descr = strchr(descr + 7, '\'');
+    if (descr == NULL) return -1;
+    if (strncmp(descr, "'<f8'", 5) == 0) {
+        *dtype = 'd';
+    } else if (strncmp(descr, "'<f4'", 5) == 0) {
+        *dtype = 'f';
+    } else if (strncmp(descr, "'<i8'", 5) == 0 || strncmp(descr, "'<u8'", 5) == 0) {
+        *dtype = 'i';
+    } else {
+        return -1;
+    }
+
+    fortran += 15;
+    while (*fortran == ' ' || *fortran == ':') fortran++;
+    if (strncmp(fortran, "False", 5) != 0) {
+        return -1;
+    }
+
+    shape = strchr(shape, '(');
+    if (shape == NULL) return -1;
+    int nd = 0;
+    for (shape++;;) {
+        while (*shape == ' ' || *shape == ',') shape++;
+        if (*shape == ')') break;
+        char* stop;
+        uint64_t dim = strtoull(shape, &stop, 10);
+        if (stop == shape || *shape == '-' || dim == 0 || nd == NPY_MAX_DIMS) return -1;
+        dims[nd++] = dim;
+        shape      = (*stop == 'L') ? stop + 1 : stop;
+    }
+    return nd;
+}
+
+ndarray_t* ndarray_load(const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
         perror("Failed to open file");
         return NULL;
     }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 10 || !npy_host_little_endian()) {
+        close(fd);
+        return NULL;
+    }
 
-    // Read dimensions (assuming the first line contains the shape)
-    uint64_t n_samples, n_features;
-    fscanf(file, "%llu,%llu", &n_samples, &n_features);
-    uint64_t dim[2]  = {n_samples, n_features};
-    ndarray_t* array = ndarray_create(dim, 2, dtype);
-    if (!array) {
-        fclose(file);
+    // Private writable mapping: pages are read on first touch and writes never reach the file
+    uint8_t* mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("Failed to map file");
         return NULL;
     }
 
-    // Read data
-    for (uint64_t i = 0; i < n_samples; i++) {
-        for (uint64_t j = 0; j < n_features; j++) {
-            if (dtype == 'd') {
-                fscanf(file, "%lf", (double*)array->data + i * n_features + j);
-            } else if (dtype == 'f') {
-                fscanf(file, "%f", (float*)array->data + i * n_features + j);
-            }
-        }
+    // Version 1.0 has a 2-byte header length, 2.0 and 3.0 a 4-byte one
+    int version     = mapping[6];
+    size_t prefix   = (version == 1) ? 10 : 12;
+    size_t head_len = 0;
+    if (memcmp(mapping, NPY_MAGIC, 6) == 0 && version >= 1 && version <= 3 && (size_t)st.st_size >= prefix) {
+        head_len = mapping[8] | (size_t)mapping[9] << 8;
+        if (version > 1) head_len |= (size_t)mapping[10] << 16 | (size_t)mapping[11] << 24;
+    }
+
+    char dtype;
+    uint64_t dims[NPY_MAX_DIMS];
+    int nd       = -1;
+    char* header = (head_len && prefix + head_len <= (size_t)st.st_size) ? malloc(head_len + 1) : NULL;
+    if (header) {
+        memcpy(header, mapping + prefix, head_len);
+        header[head_len] = '\0';
+        nd               = npy_parse_header(header, &dtype, dims);
+        free(header);
     }
 
-    fclose(file);
+    // The shape must fit the bytes after the header, a product that overflows never does
+    size_t bytes = (nd >= 1) ? calculate_type_size(dtype) : 0;
+    for (int i = 0; i < nd && bytes; i++) {
+        bytes = (dims[i] <= SIZE_MAX / bytes) ? bytes * dims[i] : 0;
+    }
+    if (bytes == 0 || bytes > (size_t)st.st_size - prefix - head_len) {
+        printf("Unsupported or truncated .npy file: %s.\n", filename);
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+
+    ndarray_t* array  = calloc(1, sizeof(ndarray_t));
+    uint64_t* shape   = malloc(nd * sizeof(uint64_t));
+    uint64_t* strides = malloc(nd * sizeof(uint64_t));
+    if (!array || !shape || !strides) {
+        printf("Memory allocation failed.\n");
+        free(array);
+        free(shape);
+        free(strides);
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+    memcpy(shape, dims, nd * sizeof(uint64_t));
+    strides[nd - 1] = calculate_type_size(dtype);
+    for (int i = nd - 2; i >= 0; i--) {
+        strides[i] = strides[i + 1] * shape[i + 1];
+    }
+    array->data         = mapping + prefix + head_len;
+    array->dimensions   = shape;
+    array->strides      = strides;
+    array->nd           = nd;
+    array->dtype        = dtype;
+    array->owner        = NDARRAY_OWNER_MMAP;
+    array->mapping      = mapping;
+    array->mapping_size = st.st_size;
     return array;
 }
 
@@ -288,35 +817,117 @@ uint64_t ndarray_size(const ndarray_t* array)
 
 // Helper functions end <====
 
-// Transpose the 2D Array(matrix)
-ndarray_t* ndarray_transpose(const ndarray_t* array)
+// Header of a view over array's data, same shape and strides
+static ndarray_t* ndarray_view(const ndarray_t* array)
 {
-    if (array->nd != 2) {
+    ndarray_t* view   = calloc(1, sizeof(ndarray_t));
+    uint64_t* shape   = malloc(array->nd * sizeof(uint64_t));
+    uint64_t* strides = malloc(array->nd * sizeof(uint64_t));
+    if (!view || !shape || !strides) {
+        printf("Memory allocation failed.\n");
+        free(view);
+        free(shape);
+        free(strides);
         return NULL;
     }
+    memcpy(shape, array->dimensions, array->nd * sizeof(uint64_t));
+    memcpy(strides, array->strides, array->nd * sizeof(uint64_t));
+    view->data       = array->data;
+    view->dimensions = shape;
+    view->strides    = strides;
+    view->nd         = array->nd;
+    view->dtype      = array->dtype;
+    view->owner      = NDARRAY_OWNER_NONE;
+    return view;
+}
 
-    uint64_t dim[2]       = {array->dimensions[1], array->dimensions[0]};
-    ndarray_t* transposed = ndarray_create(dim, 2, array->dtype);
-    if (!transposed) return NULL;
+// Elements start, start + step, ... below stop along axis
+ndarray_t* ndarray_slice(const ndarray_t* array, uint32_t axis, uint64_t start, uint64_t stop, uint64_t step)
+{
+    if (axis >= array->nd || step == 0 || start > stop || stop > array->dimensions[axis]) {
+        return NULL;
+    }
 
-    for (uint64_t i = 0; i < array->dimensions[0]; i++) {
-        for (uint64_t j = 0; j < array->dimensions[1]; j++) {
-            if (array->dtype == 'd') {
-                ((double*)transposed->data)[j * array->dimensions[0] + i] = ((double*)array->data)[i * array->dimensions[1] + j];
-            } else if (array->dtype == 'f') {
-                ((float*)transposed->data)[j * array->dimensions[0] + i] = ((float*)array->data)[i * array->dimensions[1] + j];
+    ndarray_t* view = ndarray_view(array);
+    if (!view) return NULL;
+
+    view->data             = (uint8_t*)array->data + start * array->strides[axis];
+    view->dimensions[axis] = (stop - start + step - 1) / step;
+    view->strides[axis]    = array->strides[axis] * step;
+    return view;
+}
+
+// Transpose by reversing the axes, a 2D array becomes its matrix transpose
+ndarray_t* ndarray_transpose(const ndarray_t* array)
+{
+    ndarray_t* view = ndarray_view(array);
+    if (!view) return NULL;
+
+    for (uint32_t i = 0; i < array->nd; i++) {
+        view->dimensions[i] = array->dimensions[array->nd - 1 - i];
+        view->strides[i]    = array->strides[array->nd - 1 - i];
+    }
+    return view;
+}
+
+// Elements in C order with no gaps, axes of length 1 may have any stride
+int ndarray_is_contiguous(const ndarray_t* array)
+{
+    uint64_t expected = calculate_type_size(array->dtype);
+    for (int i = (int)array->nd - 1; i >= 0; i--) {
+        if (array->dimensions[i] > 1 && array->strides[i] != expected) {
+            return 0;
+        }
+        expected *= array->dimensions[i];
+    }
+    return 1;
+}
+
+// Copy src into dst of the same shape, both with any strides. Rows along the last
+// axis are located from the outer indices, then copied whole when both are packed.
+static void copy_strided(const ndarray_t* dst, const ndarray_t* src)
+{
+    size_t type_size = calculate_type_size(src->dtype);
+    uint32_t last    = src->nd - 1;
+    uint64_t inner   = src->dimensions[last];
+    uint64_t size    = ndarray_size(src);
+    uint64_t outer   = inner ? size / inner : 0;
+    int packed       = (src->strides[last] == type_size && dst->strides[last] == type_size);
+
+    for (uint64_t r = 0; r < outer; r++) {
+        const uint8_t* from = src->data;
+        uint8_t* to         = dst->data;
+        uint64_t rest       = r;
+        for (int i = (int)last - 1; i >= 0; i--) {
+            uint64_t idx = rest % src->dimensions[i];
+            from += idx * src->strides[i];
+            to += idx * dst->strides[i];
+            rest /= src->dimensions[i];
+        }
+        if (packed) {
+            memcpy(to, from, inner * type_size);
+        } else {
+            for (uint64_t j = 0; j < inner; j++) {
+                memcpy(to + j * dst->strides[last], from + j * src->strides[last], type_size);
             }
         }
     }
+}
+
+ndarray_t* ndarray_copy(const ndarray_t* array)
+{
+    ndarray_t* copy = ndarray_create(array->dimensions, array->nd, array->dtype);
+    if (!copy) return NULL;
 
-    return transposed;
+    copy_strided(copy, array);
+    return copy;
 }
 
 // Arithmetic Operations: Addition
 ndarray_t* ndarray_add(ndarray_t* result, const ndarray_t* a, const ndarray_t* b)
 {
-    if (a->nd != b->nd || a->dtype != b->dtype) {
-        return NULL;  // Incompatible dimensions or types
+    if (a->nd != b->nd || a->dtype != b->dtype || !ndarray_is_contiguous(a) || !ndarray_is_contiguous(b)) {
+        return NULL;  // Incompatible dimensions or types, or a view to copy first
     }
 
     for (uint32_t i = 0; i < a->nd; i++) {
@@ -343,8 +954,8 @@ ndarray_t* ndarray_add(ndarray_t* result, const ndarray_t* a, const ndarray_t* b
 // Arithmetic Operations: Subtraction
 ndarray_t* ndarray_subtract(ndarray_t* result, const ndarray_t* a, const ndarray_t* b)
 {
-    if (a->nd != b->nd || a->dtype != b->dtype) {
-        return NULL;  // Incompatible dimensions or types
+    if (a->nd != b->nd || a->dtype != b->dtype || !ndarray_is_contiguous(a) || !ndarray_is_contiguous(b)) {
+        return NULL;  // Incompatible dimensions or types, or a view to copy first
     }
 
     for (uint32_t i = 0; i < a->nd; i++) {
@@ -368,43 +979,435 @@ ndarray_t* ndarray_subtract(ndarray_t* result, const ndarray_t* a, const ndarray
     return result;
 }
 
-// Arithmetic Operations: Dot Product
-ndarray_t* ndarray_dot(ndarray_t* result, const ndarray_t* a, const ndarray_t* b)
+// Matrix product, blocked like BLIS. B is packed into panels of kernel.nr columns and A into
+// panels of DOT_MR rows, both DOT_KC deep, so a micro-kernel streams two contiguous panels
+// while a DOT_MR x nr tile of C stays in registers. A block of DOT_MC rows of A is reused
+// against every B panel from L2, and the row blocks are shared out between threads.
+#define DOT_MR       4
+#define DOT_MAX_NR   32
+#define DOT_KC       256
+#define DOT_MC       64
+#define DOT_NC       2048
+#define DOT_PARALLEL ((uint64_t)1 << 22)  // Multiply-adds below which threads cost more than they save
+
+// C[DOT_MR x nr] += A panel * B panel over kc steps, rows of C are ldc elements apart
+typedef void (*dot_kernel_fn)(int64_t kc, const void* a, const void* b, void* c, int64_t ldc);
+
+typedef struct {
+    int nr;            // Columns of a B panel and of the C tile
+    dot_kernel_fn fn;
+} dot_kernel;
+
+typedef struct {
+    const ndarray_t* a;
+    const ndarray_t* b;
+    ndarray_t* c;
+    dot_kernel kernel;
+    uint8_t* b_pack;           // Packed block of B, kc x nc
+    uint8_t** a_pack;          // Packed block of A for each worker, DOT_MC x kc
+    uint64_t pc, kc;           // Rows of B in the current block
+    uint64_t jc, nc;           // Columns of B in the current block
+    atomic_ullong next_block;  // First row of the next block of A
+} dot_ctx;
+
+static void dot_kernel_d(int64_t kc, const void* a, const void* b, void* c, int64_t ldc)
 {
-    if (a->nd != 2 || b->nd != 2 || a->dtype != b->dtype || a->dimensions[1] != b->dimensions[0]) {
-        return NULL;  // Incompatible dimensions or types
+    const double* pa = a;
+    const double* pb = b;
+    double acc[DOT_MR][8];
+    memset(acc, 0, sizeof(acc));
+    for (int64_t p = 0; p < kc; p++, pa += DOT_MR, pb += 8) {
+        for (int i = 0; i < DOT_MR; i++) {
+            for (int j = 0; j < 8; j++) {
+                acc[i][j] += pa[i] * pb[j];
+            }
+        }
+    }
+    for (int i = 0; i < DOT_MR; i++) {
+        for (int j = 0; j < 8; j++) {
+            ((double*)c)[i * ldc + j] += acc[i][j];
+        }
     }
+}
 
-    if (!result)
-        result = ndarray_create(a->dimensions, a->nd, a->dtype);
-    if (!result) return NULL;
+static void dot_kernel_f(int64_t kc, const void* a, const void* b, void* c, int64_t ldc)
+{
+    const float* pa = a;
+    const float* pb = b;
+    float acc[DOT_MR][8];
+    memset(acc, 0, sizeof(acc));
+    for (int64_t p = 0; p < kc; p++, pa += DOT_MR, pb += 8) {
+        for (int i = 0; i < DOT_MR; i++) {
+            for (int j = 0; j < 8; j++) {
+                acc[i][j] += pa[i] * pb[j];
+            }
+        }
+    }
+    for (int i = 0; i < DOT_MR; i++) {
+        for (int j = 0; j < 8; j++) {
+            ((float*)c)[i * ldc + j] += acc[i][j];
+        }
+    }
+}
 
-    for (uint64_t i = 0; i < a->dimensions[0]; i++) {
-        for (uint64_t j = 0; j < b->dimensions[1]; j++) {
-            double sum = 0.0;
-            for (uint64_t k = 0; k < a->dimensions[1]; k++) {
-                if (a->dtype == 'd') {
-                    sum += ((double*)a->data)[i * a->dimensions[1] + k] * ((double*)b->data)[k * b->dimensions[1] + j];
-                } else if (a->dtype == 'f') {
-                    sum += ((float*)a->data)[i * a->dimensions[1] + k] * ((float*)b->data)[k * b->dimensions[1] + j];
+#if defined(__GNUC__) && defined(__x86_64__)
+// Each row of the tile is two vectors, eight independent FMA chains in all
+__attribute__((target("avx2,fma"))) static void dot_kernel_d_avx2(int64_t kc, const void* a, const void* b, void* c, int64_t ldc)
+{
+    const double* pa = a;
+    const double* pb = b;
+    __m256d c00      = _mm256_setzero_pd();
+    __m256d c01      = _mm256_setzero_pd();
+    __m256d c10      = _mm256_setzero_pd();
+    __m256d c11      = _mm256_setzero_pd();
+    __m256d c20      = _mm256_setzero_pd();
+    __m256d c21      = _mm256_setzero_pd();
+    __m256d c30      = _mm256_setzero_pd();
+    __m256d c31      = _mm256_setzero_pd();
+    for (int64_t p = 0; p < kc; p++, pa += DOT_MR, pb += 8) {
+        __m256d b0 = _mm256_loadu_pd(pb);
+        __m256d b1 = _mm256_loadu_pd(pb + 4);
+        __m256d ai = _mm256_broadcast_sd(pa);
+        c00        = _mm256_fmadd_pd(ai, b0, c00);
+        c01        = _mm256_fmadd_pd(ai, b1, c01);
+        ai         = _mm256_broadcast_sd(pa + 1);
+        c10        = _mm256_fmadd_pd(ai, b0, c10);
+        c11        = _mm256_fmadd_pd(ai, b1, c11);
+        ai         = _mm256_broadcast_sd(pa + 2);
+        c20        = _mm256_fmadd_pd(ai, b0, c20);
+        c21        = _mm256_fmadd_pd(ai, b1, c21);
+        ai         = _mm256_broadcast_sd(pa + 3);
+        c30        = _mm256_fmadd_pd(ai, b0, c30);
+        c31        = _mm256_fmadd_pd(ai, b1, c31);
+    }
+    double* row = c;
+    _mm256_storeu_pd(row, _mm256_add_pd(_mm256_loadu_pd(row), c00));
+    _mm256_storeu_pd(row + 4, _mm256_add_pd(_mm256_loadu_pd(row + 4), c01));
+    row += ldc;
+    _mm256_storeu_pd(row, _mm256_add_pd(_mm256_loadu_pd(row), c10));
+    _mm256_storeu_pd(row + 4, _mm256_add_pd(_mm256_loadu_pd(row + 4), c11));
+    row += ldc;
+    _mm256_storeu_pd(row, _mm256_add_pd(_mm256_loadu_pd(row), c20));
+    _mm256_storeu_pd(row + 4, _mm256_add_pd(_mm256_loadu_pd(row + 4), c21));
+    row += ldc;
+    _mm256_storeu_pd(row, _mm256_add_pd(_mm256_loadu_pd(row), c30));
+    _mm256_storeu_pd(row + 4, _mm256_add_pd(_mm256_loadu_pd(row + 4), c31));
+}
+
+__attribute__((target("avx2,fma"))) static void dot_kernel_f_avx2(int64_t kc, const void* a, const void* b, void* c, int64_t ldc)
+{
+    const float* pa = a;
+    const float* pb = b;
+    __m256 c00      = _mm256_setzero_ps();
+    __m256 c01      = _mm256_setzero_ps();
+    __m256 c10      = _mm256_setzero_ps();
+    __m256 c11      = _mm256_setzero_ps();
+    __m256 c20      = _mm256_setzero_ps();
+    __m256 c21      = _mm256_setzero_ps();
+    __m256 c30      = _mm256_setzero_ps();
+    __m256 c31      = _mm256_setzero_ps();
+    for (int64_t p = 0; p < kc; p++, pa += DOT_MR, pb += 16) {
+        __m256 b0 = _mm256_loadu_ps(pb);
+        __m256 b1 = _mm256_loadu_ps(pb + 8);
+        __m256 ai = _mm256_broadcast_ss(pa);
+        c00       = _mm256_fmadd_ps(ai, b0, c00);
+        c01       = _mm256_fmadd_ps(ai, b1, c01);
+        ai        = _mm256_broadcast_ss(pa + 1);
+        c10       = _mm256_fmadd_ps(ai, b0, c10);
+        c11       = _mm256_fmadd_ps(ai, b1, c11);
+        ai        = _mm256_broadcast_ss(pa + 2);
+        c20       = _mm256_fmadd_ps(ai, b0, c20);
+        c21       = _mm256_fmadd_ps(ai, b1, c21);
+        ai        = _mm256_broadcast_ss(pa + 3);
+        c30       = _mm256_fmadd_ps(ai, b0, c30);
+        c31       = _mm256_fmadd_ps(ai, b1, c31);
+    }
+    float* row = c;
+    _mm256_storeu_ps(row, _mm256_add_ps(_mm256_loadu_ps(row), c00));
+    _mm256_storeu_ps(row + 8, _mm256_add_ps(_mm256_loadu_ps(row + 8), c01));
+    row += ldc;
+    _mm256_storeu_ps(row, _mm256_add_ps(_mm256_loadu_ps(row), c10));
+    _mm256_storeu_ps(row + 8, _mm256_add_ps(_mm256_loadu_ps(row + 8), c11));
+    row += ldc;
+    _mm256_storeu_ps(row, _mm256_add_ps(_mm256_loadu_ps(row), c20));
+    _mm256_storeu_ps(row + 8, _mm256_add_ps(_mm256_loadu_ps(row + 8), c21));
+    row += ldc;
+    _mm256_storeu_ps(row, _mm256_add_ps(_mm256_loadu_ps(row), c30));
+    _mm256_storeu_ps(row + 8, _mm256_add_ps(_mm256_loadu_ps(row + 8), c31));
+}
+
+__attribute__((target("avx512f"))) static void dot_kernel_d_avx512(int64_t kc, const void* a, const void* b, void* c, int64_t ldc)
+{
+    const double* pa = a;
+    const double* pb = b;
+    __m512d c00      = _mm512_setzero_pd();
+    __m512d c01      = _mm512_setzero_pd();
+    __m512d c10      = _mm512_setzero_pd();
+    __m512d c11      = _mm512_setzero_pd();
+    __m512d c20      = _mm512_setzero_pd();
+    __m512d c21      = _mm512_setzero_pd();
+    __m512d c30      = _mm512_setzero_pd();
+    __m512d c31      = _mm512_setzero_pd();
+    for (int64_t p = 0; p < kc; p++, pa += DOT_MR, pb += 16) {
+        __m512d b0 = _mm512_loadu_pd(pb);
+        __m512d b1 = _mm512_loadu_pd(pb + 8);
+        __m512d ai = _mm512_set1_pd(pa[0]);
+        c00        = _mm512_fmadd_pd(ai, b0, c00);
+        c01        = _mm512_fmadd_pd(ai, b1, c01);
+        ai         = _mm512_set1_pd(pa[1]);
+        c10        = _mm512_fmadd_pd(ai, b0, c10);
+        c11        = _mm512_fmadd_pd(ai, b1, c11);
+        ai         = _mm512_set1_pd(pa[2]);
+        c20        = _mm512_fmadd_pd(ai, b0, c20);
+        c21        = _mm512_fmadd_pd(ai, b1, c21);
+        ai         = _mm512_set1_pd(pa[3]);
+        c30        = _mm512_fmadd_pd(ai, b0, c30);
+        c31        = _mm512_fmadd_pd(ai, b1, c31);
+    }
+    double* row = c;
+    _mm512_storeu_pd(row, _mm512_add_pd(_mm512_loadu_pd(row), c00));
+    _mm512_storeu_pd(row + 8, _mm512_add_pd(_mm512_loadu_pd(row + 8), c01));
+    row += ldc;
+    _mm512_storeu_pd(row, _mm512_add_pd(_mm512_loadu_pd(row), c10));
+    _mm512_storeu_pd(row + 8, _mm512_add_pd(_mm512_loadu_pd(row + 8), c11));
+    row += ldc;
+    _mm512_storeu_pd(row, _mm512_add_pd(_mm512_loadu_pd(row), c20));
+    _mm512_storeu_pd(row + 8, _mm512_add_pd(_mm512_loadu_pd(row + 8), c21));
+    row += ldc;
+    _mm512_storeu_pd(row, _mm512_add_pd(_mm512_loadu_pd(row), c30));
+    _mm512_storeu_pd(row + 8, _mm512_add_pd(_mm512_loadu_pd(row + 8), c31));
+}
+
+__attribute__((target("avx512f"))) static void dot_kernel_f_avx512(int64_t kc, const void* a, const void* b, void* c, int64_t ldc)
+{
+    const float* pa = a;
+    const float* pb = b;
+    __m512 c00      = _mm512_setzero_ps();
+    __m512 c01      = _mm512_setzero_ps();
+    __m512 c10      = _mm512_setzero_ps();
+    __m512 c11      = _mm512_setzero_ps();
+    __m512 c20      = _mm512_setzero_ps();
+    __m512 c21      = _mm512_setzero_ps();
+    __m512 c30      = _mm512_setzero_ps();
+    __m512 c31      = _mm512_setzero_ps();
+    for (int64_t p = 0; p < kc; p++, pa += DOT_MR, pb += 32) {
+        __m512 b0 = _mm512_loadu_ps(pb);
+        __m512 b1 = _mm512_loadu_ps(pb + 16);
+        __m512 ai = _mm512_set1_ps(pa[0]);
+        c00       = _mm512_fmadd_ps(ai, b0, c00);
+        c01       = _mm512_fmadd_ps(ai, b1, c01);
+        ai        = _mm512_set1_ps(pa[1]);
+        c10       = _mm512_fmadd_ps(ai, b0, c10);
+        c11       = _mm512_fmadd_ps(ai, b1, c11);
+        ai        = _mm512_set1_ps(pa[2]);
+        c20       = _mm512_fmadd_ps(ai, b0, c20);
+        c21       = _mm512_fmadd_ps(ai, b1, c21);
+        ai        = _mm512_set1_ps(pa[3]);
+        c30       = _mm512_fmadd_ps(ai, b0, c30);
+        c31       = _mm512_fmadd_ps(ai, b1, c31);
+    }
+    float* row = c;
+    _mm512_storeu_ps(row, _mm512_add_ps(_mm512_loadu_ps(row), c00));
+    _mm512_storeu_ps(row + 16, _mm512_add_ps(_mm512_loadu_ps(row + 16), c01));
+    row += ldc;
+    _mm512_storeu_ps(row, _mm512_add_ps(_mm512_loadu_ps(row), c10));
+    _mm512_storeu_ps(row + 16, _mm512_add_ps(_mm512_loadu_ps(row + 16), c11));
+    row += ldc;
+    _mm512_storeu_ps(row, _mm512_add_ps(_mm512_loadu_ps(row), c20));
+    _mm512_storeu_ps(row + 16, _mm512_add_ps(_mm512_loadu_ps(row + 16), c21));
+    row += ldc;
+    _mm512_storeu_ps(row, _mm512_add_ps(_mm512_loadu_ps(row), c30));
+    _mm512_storeu_ps(row + 16, _mm512_add_ps(_mm512_loadu_ps(row + 16), c31));
+}
+#endif
+
+static dot_kernel dot_kernel_d_impl = {8, dot_kernel_d};
+static dot_kernel dot_kernel_f_impl = {8, dot_kernel_f};
+static pthread_once_t dot_once      = PTHREAD_ONCE_INIT;
+
+// Unlike tree traversal, GEMM is bound by FMA throughput, so AVX-512 is the default where
+// the host has it. IFOREST_SIMD=scalar|avx2 caps the choice as it does for scoring.
+static void dot_dispatch(void)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+    const char* simd = getenv("IFOREST_SIMD");
+    int want_avx512  = (simd == NULL || strcmp(simd, "avx512") == 0);
+    int want_avx2    = (want_avx512 || strcmp(simd, "avx2") == 0);
+
+    __builtin_cpu_init();
+    if (want_avx512 && __builtin_cpu_supports("avx512f")) {
+        dot_kernel_d_impl = (dot_kernel){16, dot_kernel_d_avx512};
+        dot_kernel_f_impl = (dot_kernel){32, dot_kernel_f_avx512};
+    } else if (want_avx2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        dot_kernel_d_impl = (dot_kernel){8, dot_kernel_d_avx2};
+        dot_kernel_f_impl = (dot_kernel){16, dot_kernel_f_avx2};
+    }
+#endif
+}
+
+// Rows [ic, ic + mc) of the current block of A into panels of DOT_MR rows, stored column
+// by column. The last panel is padded with zeros. A is read through its strides.
+static void dot_pack_a(const dot_ctx* ctx, uint64_t ic, uint64_t mc, void* dst)
+{
+    const ndarray_t* a = ctx->a;
+    uint64_t i         = 0;
+    for (uint64_t ir = 0; ir < mc; ir += DOT_MR) {
+        for (uint64_t p = 0; p < ctx->kc; p++) {
+            const uint8_t* src = (const uint8_t*)a->data + (ic + ir) * a->strides[0] + (ctx->pc + p) * a->strides[1];
+            for (uint64_t r = 0; r < DOT_MR; r++, i++) {
+                if (a->dtype == 'f') {
+                    ((float*)dst)[i] = (ir + r < mc) ? *(const float*)(src + r * a->strides[0]) : 0;
+                } else {
+                    ((double*)dst)[i] = (ir + r < mc) ? *(const double*)(src + r * a->strides[0]) : 0;
                 }
             }
-            if (a->dtype == 'd') {
-                ((double*)result->data)[i * b->dimensions[1] + j] = sum;
-            } else if (a->dtype == 'f') {
-                ((float*)result->data)[i * b->dimensions[1] + j] = (float)sum;
+        }
+    }
+}
+
+// The current block of B into panels of nr columns, stored row by row. The last panel
+// is padded with zeros.
+static void dot_pack_b(const dot_ctx* ctx)
+{
+    const ndarray_t* b = ctx->b;
+    uint64_t nr        = ctx->kernel.nr;
+    uint64_t i         = 0;
+    for (uint64_t jr = 0; jr < ctx->nc; jr += nr) {
+        for (uint64_t p = 0; p < ctx->kc; p++) {
+            const uint8_t* src = (const uint8_t*)b->data + (ctx->pc + p) * b->strides[0] + (ctx->jc + jr) * b->strides[1];
+            for (uint64_t j = 0; j < nr; j++, i++) {
+                if (b->dtype == 'f') {
+                    ((float*)ctx->b_pack)[i] = (jr + j < ctx->nc) ? *(const float*)(src + j * b->strides[1]) : 0;
+                } else {
+                    ((double*)ctx->b_pack)[i] = (jr + j < ctx->nc) ? *(const double*)(src + j * b->strides[1]) : 0;
+                }
             }
         }
     }
+}
 
-    return result;
+// Multiply rows [ic, ic + mc) of the current block of A with the packed block of B. Tiles
+// over the edge of C are computed in full into scratch and only their inside is added.
+static void dot_block(const dot_ctx* ctx, uint64_t ic, uint64_t mc, uint8_t* a_pack)
+{
+    size_t type_size = calculate_type_size(ctx->c->dtype);
+    uint64_t n       = ctx->c->dimensions[1];
+    uint64_t nr      = ctx->kernel.nr;
+    double tile[DOT_MR * DOT_MAX_NR];
+
+    dot_pack_a(ctx, ic, mc, a_pack);
+    for (uint64_t jr = 0; jr < ctx->nc; jr += nr) {
+        const uint8_t* b_panel = ctx->b_pack + jr * ctx->kc * type_size;
+        uint64_t cols          = (ctx->nc - jr < nr) ? ctx->nc - jr : nr;
+        for (uint64_t ir = 0; ir < mc; ir += DOT_MR) {
+            const uint8_t* a_panel = a_pack + ir * ctx->kc * type_size;
+            uint64_t rows          = (mc - ir < DOT_MR) ? mc - ir : DOT_MR;
+            uint8_t* c             = (uint8_t*)ctx->c->data + ((ic + ir) * n + ctx->jc + jr) * type_size;
+            if (rows == DOT_MR && cols == nr) {
+                ctx->kernel.fn(ctx->kc, a_panel, b_panel, c, n);
+                continue;
+            }
+            memset(tile, 0, sizeof(tile));
+            ctx->kernel.fn(ctx->kc, a_panel, b_panel, tile, nr);
+            for (uint64_t r = 0; r < rows; r++) {
+                for (uint64_t j = 0; j < cols; j++) {
+                    if (ctx->c->dtype == 'f') {
+                        ((float*)c)[r * n + j] += ((float*)tile)[r * nr + j];
+                    } else {
+                        ((double*)c)[r * n + j] += tile[r * nr + j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void dot_worker(void* arg, int worker)
+{
+    dot_ctx* ctx = (dot_ctx*)arg;
+    uint64_t m   = ctx->c->dimensions[0];
+    for (uint64_t ic = atomic_fetch_add(&ctx->next_block, DOT_MC); ic < m; ic = atomic_fetch_add(&ctx->next_block, DOT_MC)) {
+        dot_block(ctx, ic, (m - ic < DOT_MC) ? m - ic : DOT_MC, ctx->a_pack[worker]);
+    }
+}
+
+// Matrix product of 2D arrays a (m, k) and b (k, n) of dtype 'd' or 'f', either may be a
+// view. result, if given, must be a contiguous (m, n) array of the same dtype.
+ndarray_t* ndarray_dot(ndarray_t* result, const ndarray_t* a, const ndarray_t* b)
+{
+    if (a->nd != 2 || b->nd != 2 || a->dtype != b->dtype || (a->dtype != 'd' && a->dtype != 'f') ||
+        a->dimensions[1] != b->dimensions[0]) {
+        return NULL;  // Incompatible dimensions or types
+    }
+
+    uint64_t m       = a->dimensions[0];
+    uint64_t k       = a->dimensions[1];
+    uint64_t n       = b->dimensions[1];
+    uint64_t dims[2] = {m, n};
+    if (result && (result->nd != 2 || result->dtype != a->dtype || result->dimensions[0] != m || result->dimensions[1] != n ||
+                   !ndarray_is_contiguous(result))) {
+        return NULL;
+    }
+    ndarray_t* created = result ? NULL : ndarray_create(dims, 2, a->dtype);
+    result             = result ? result : created;
+    if (!result) return NULL;
+
+    size_t type_size = calculate_type_size(a->dtype);
+    if (m * n > 0) memset(result->data, 0, m * n * type_size);
+    if (m * n * k == 0) return result;
+
+    pthread_once(&dot_once, dot_dispatch);
+    dot_ctx ctx;
+    ctx.a      = a;
+    ctx.b      = b;
+    ctx.c      = result;
+    ctx.kernel = (a->dtype == 'f') ? dot_kernel_f_impl : dot_kernel_d_impl;
+
+    // Threads only pay off for large products with several row blocks to share
+    thread_pool* pool = (m * n * k >= DOT_PARALLEL && m > DOT_MC) ? get_shared_pool() : NULL;
+    int num_workers   = pool ? thread_pool_size(pool) : 1;
+
+    // Panels are read whole by the kernels, so buffers are rounded up to full panels
+    uint64_t kc_max  = (k < DOT_KC) ? k : DOT_KC;
+    uint64_t nc_max  = (n < DOT_NC) ? n : DOT_NC;
+    uint64_t mc_max  = (m < DOT_MC) ? m : DOT_MC;
+    size_t b_bytes   = (nc_max + ctx.kernel.nr - 1) / ctx.kernel.nr * ctx.kernel.nr * kc_max * type_size;
+    size_t a_bytes   = (mc_max + DOT_MR - 1) / DOT_MR * DOT_MR * kc_max * type_size;
+    ctx.b_pack       = aligned_alloc(64, (b_bytes + 63) & ~(size_t)63);
+    ctx.a_pack       = calloc(num_workers, sizeof(uint8_t*));
+    int ok           = (ctx.b_pack != NULL && ctx.a_pack != NULL);
+    for (int w = 0; ok && w < num_workers; w++) {
+        ctx.a_pack[w] = aligned_alloc(64, (a_bytes + 63) & ~(size_t)63);
+        ok            = (ctx.a_pack[w] != NULL);
+    }
+
+    for (uint64_t jc = 0; ok && jc < n; jc += DOT_NC) {
+        for (uint64_t pc = 0; pc < k; pc += DOT_KC) {
+            ctx.jc = jc;
+            ctx.nc = (n - jc < DOT_NC) ? n - jc : DOT_NC;
+            ctx.pc = pc;
+            ctx.kc = (k - pc < DOT_KC) ? k - pc : DOT_KC;
+            dot_pack_b(&ctx);
+            atomic_init(&ctx.next_block, 0);
+            shared_pool_run(pool, dot_worker, &ctx);
+        }
+    }
+
+    if (!ok) printf("Memory allocation failed.\n");
+    for (int w = 0; ctx.a_pack && w < num_workers; w++) {
+        free(ctx.a_pack[w]);
+    }
+    free(ctx.a_pack);
+    free(ctx.b_pack);
+    if (!ok && created) ndarray_free(created);
+    return ok ? result : NULL;
 }
 
 // Broadcasting: Here is a simplified version for 2D arrays
 ndarray_t* ndarray_broadcast_add(ndarray_t* result, const ndarray_t* a, const ndarray_t* b)
 {
-    if (a->nd != 2 || b->nd != 2 || a->dtype != b->dtype) {
-        return NULL;  // Incompatible dimensions or types
+    if (a->nd != 2 || b->nd != 2 || a->dtype != b->dtype || !ndarray_is_contiguous(a) || !ndarray_is_contiguous(b)) {
+        return NULL;  // Incompatible dimensions or types, or a view to copy first
     }
 
     uint64_t rows = a->dimensions[0] > b->dimensions[0] ? a->dimensions[0] : b->dimensions[0];
@@ -433,8 +1436,8 @@ ndarray_t* ndarray_broadcast_add(ndarray_t* result, const ndarray_t* a, const nd
 // Comparison Operations
 ndarray_t* ndarray_compare(ndarray_t* result, const ndarray_t* a, const ndarray_t* b, char op)
 {
-    if (a->nd != b->nd || a->dtype != b->dtype) {
-        return NULL;  // Incompatible dimensions or types
+    if (a->nd != b->nd || a->dtype != b->dtype || !ndarray_is_contiguous(a) || !ndarray_is_contiguous(b)) {
+        return NULL;  // Incompatible dimensions or types, or a view to copy first
     }
 
     for (uint32_t i = 0; i < a->nd; i++) {
@@ -486,8 +1489,10 @@ ndarray_t* ndarray_subsample(const ndarray_t* array, uint64_t n_samples)
     }
 
     ndarray_t* subsampled = ndarray_create(new_dims, array->nd, array->dtype);
-    free(new_dims);
-    if (!subsampled) return NULL;
+    if (!subsampled) {
+        free(new_dims);
+        return NULL;
+    }
 
     srand(time(NULL));
     uint64_t* indices = malloc(array->dimensions[0] * sizeof(uint64_t));
@@ -503,17 +1508,19 @@ ndarray_t* ndarray_subsample(const ndarray_t* array, uint64_t n_samples)
         indices[j]    = temp;
     }
 
-    // Copy data
+    // Copy rows through the strides, array may be a view
+    ndarray_t src  = *array;
+    ndarray_t dst  = *subsampled;
+    new_dims[0]    = 1;
+    src.dimensions = new_dims;
+    dst.dimensions = new_dims;
     for (uint64_t i = 0; i < n_samples; i++) {
-        for (uint64_t j = 0; j < array->dimensions[1]; j++) {
-            if (array->dtype == 'd') {
-                ((double*)subsampled->data)[i * array->dimensions[1] + j] = ((double*)array->data)[indices[i] * array->dimensions[1] + j];
-            } else if (array->dtype == 'f') {
-                ((float*)subsampled->data)[i * array->dimensions[1] + j] = ((float*)array->data)[indices[i] * array->dimensions[1] + j];
-            }
-        }
+        src.data = (uint8_t*)array->data + indices[i] * array->strides[0];
+        dst.data = (uint8_t*)subsampled->data + i * subsampled->strides[0];
+        copy_strided(&dst, &src);
     }
 
+    free(new_dims);
     free(indices);
     return subsampled;
 }
@@ -548,53 +1555,18 @@ ndarray_t* ndarray_concat(const ndarray_t* a, const ndarray_t* b, uint32_t axis)
     free(new_dims);
     if (!result) return NULL;
 
-    // Calculate element count and element size
-    uint64_t total_elements = ndarray_size(result);
-    size_t type_size        = calculate_type_size(result->dtype);
-
-    // Allocate indices array
-    uint64_t* indices = malloc(result->nd * type_size);
-    if (!indices) {
+    // Both inputs go into views of their part of the result
+    ndarray_t* head = ndarray_slice(result, axis, 0, a->dimensions[axis], 1);
+    ndarray_t* tail = ndarray_slice(result, axis, a->dimensions[axis], result->dimensions[axis], 1);
+    if (!head || !tail) {
+        if (head) ndarray_free(head);
+        if (tail) ndarray_free(tail);
         ndarray_free(result);
         return NULL;
     }
-
-    // Copy data element-wise
-    for (uint64_t linear_idx = 0; linear_idx < total_elements; linear_idx++) {
-        // Calculate multidimensional indices
-        uint64_t remainder = linear_idx;
-        for (uint32_t i = 0; i < result->nd; i++) {
-            indices[i] = remainder / result->strides[i];
-            remainder %= result->strides[i];
-        }
-
-        // Determine source array and calculate source index
-        const ndarray_t* src;
-        uint64_t axis_idx = indices[axis];
-        uint64_t src_axis;
-
-        if (axis_idx < a->dimensions[axis]) {
-            src      = a;
-            src_axis = axis_idx;
-        } else {
-            src      = b;
-            src_axis = axis_idx - a->dimensions[axis];
-        }
-
-        // Calculate source linear index
-        uint64_t src_idx = 0;
-        for (uint32_t i = 0; i < src->nd; i++) {
-            src_idx += (i == axis) ? src_axis * src->strides[i] : indices[i] * src->strides[i];
-        }
-
-        // Copy data
-        if (a->dtype == 'd') {
-            ((double*)result->data)[linear_idx] = ((double*)src->data)[src_idx];
-        } else {
-            ((float*)result->data)[linear_idx] = ((float*)src->data)[src_idx];
-        }
-    }
-
-    free(indices);
+    copy_strided(head, a);
+    copy_strided(tail, b);
+    ndarray_free(head);
+    ndarray_free(tail);
     return result;
 }
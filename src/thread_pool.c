@@ -0,0 +1,175 @@
+/*
+A simple, persistent C thread pool for fork-join style parallel work.
+
+The MIT License (MIT)
+
+Copyright (c) 2025 AndY
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#include "thread_pool.h"
+
+#include <stdlib.h>
+
+struct thread_pool {
+    pthread_t* threads;        // Background workers 1..num_threads-1
+    int num_threads;           // Workers including the caller
+    thread_pool_fn fn;         // Current job
+    void* arg;                 // Current job argument
+    unsigned long job;         // Job generation, bumped for every run
+    int remaining;             // Background workers still busy with the current job
+    int stop;                  // Set by thread_pool_free
+    pthread_mutex_t lock;      // Guards the job fields above
+    pthread_cond_t start;      // Signals a new job or stop
+    pthread_cond_t done;       // Signals remaining reached 0
+    pthread_mutex_t run_lock;  // Serializes thread_pool_run callers
+};
+
+typedef struct {
+    thread_pool* pool;
+    int worker;
+} worker_arg;
+
+static void* worker_main(void* arg)
+{
+    thread_pool* pool  = ((worker_arg*)arg)->pool;
+    int worker         = ((worker_arg*)arg)->worker;
+    unsigned long seen = 0;
+    free(arg);
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->job == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stop) break;
+
+        seen              = pool->job;
+        thread_pool_fn fn = pool->fn;
+        void* job_arg     = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        fn(job_arg, worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->remaining == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+thread_pool* thread_pool_create(int num_threads)
+{
+    thread_pool* pool = calloc(1, sizeof(thread_pool));
+    if (!pool) return NULL;
+
+    pool->num_threads = (num_threads > 0) ? num_threads : 1;
+    pool->threads     = calloc(pool->num_threads, sizeof(pthread_t));
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (int i = 1; i < pool->num_threads; i++) {
+        worker_arg* arg = malloc(sizeof(worker_arg));
+        if (arg) {
+            arg->pool   = pool;
+            arg->worker = i;
+        }
+        if (!arg || pthread_create(&pool->threads[i], NULL, worker_main, arg) != 0) {
+            free(arg);
+            pool->num_threads = i;
+            thread_pool_free(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void thread_pool_free(thread_pool* pool)
+{
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->run_lock);
+    free(pool->threads);
+    free(pool);
+}
+
+int thread_pool_size(const thread_pool* pool)
+{
+    return pool->num_threads;
+}
+
+// Caller holds run_lock
+static void run_locked(thread_pool* pool, thread_pool_fn fn, void* arg)
+{
+    if (pool->num_threads > 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->fn        = fn;
+        pool->arg       = arg;
+        pool->remaining = pool->num_threads - 1;
+        pool->job++;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    fn(arg, 0);
+
+    if (pool->num_threads > 1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->remaining > 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void thread_pool_run(thread_pool* pool, thread_pool_fn fn, void* arg)
+{
+    pthread_mutex_lock(&pool->run_lock);
+    run_locked(pool, fn, arg);
+    pthread_mutex_unlock(&pool->run_lock);
+}
+
+int thread_pool_try_run(thread_pool* pool, thread_pool_fn fn, void* arg)
+{
+    if (pthread_mutex_trylock(&pool->run_lock) != 0) {
+        return -1;
+    }
+    run_locked(pool, fn, arg);
+    pthread_mutex_unlock(&pool->run_lock);
+    return 0;
+}
@@ -1,6 +1,10 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "isolation_forest.h"
@@ -12,61 +16,66 @@
         exit(EXIT_FAILURE);                                                  \
     }
 
-// Load CSV data for testing
-ndarray_t* load_csv(const char* filename, int* num_samples, int* num_features)
+// Write text to path and load it back as a 'd' array
+static ndarray_t* csv_roundtrip(const char* path, const char* text)
 {
-    FILE* file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Error opening file: %s\n", filename);
-        exit(EXIT_FAILURE);
-    }
+    FILE* file = fopen(path, "w");
+    CHECK_PTR(file);
+    fputs(text, file);
+    fclose(file);
+    ndarray_t* array = ndarray_from_csv(path, 'd');
+    remove(path);
+    return array;
+}
 
-    char line[1024];
-    *num_samples   = 0;
-    *num_features  = 0;
-    int has_header = 1;
+// Deleter for adopted buffers, counts its calls
+static int buffers_released = 0;
+static void release_buffer(void* data)
+{
+    buffers_released++;
+    free(data);
+}
 
-    // First pass: count features and samples
-    while (fgets(line, sizeof(line), file)) {
-        if (*num_features == 0) {
-            char* token = strtok(line, ",");
-            while (token) {
-                (*num_features)++;
-                token = strtok(NULL, ",");
-            }
-        }
-        (*num_samples)++;
-    }
+// Multiplies a and b into product, products run on the shared pool or on the caller
+typedef struct {
+    const ndarray_t* a;
+    const ndarray_t* b;
+    ndarray_t* product;
+} dot_arg;
 
-    if (has_header) (*num_samples)--;
-    rewind(file);
+static void* dot_thread(void* arg)
+{
+    dot_arg* dot = (dot_arg*)arg;
+    dot->product = ndarray_dot(NULL, dot->a, dot->b);
+    return NULL;
+}
 
-    // Allocate memory
-    uint32_t nd = 2;
-    // *num_samples     = 200;
-    uint64_t dims[2] = {*num_samples, *num_features};
-    ndarray_t* data = ndarray_create(dims, nd, 'f');
-    CHECK_PTR(data);
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Scores every row until stop is set, counting scores outside (0, 1)
+typedef struct {
+    isolation_forest* forest;
+    ndarray_t* data;
+    atomic_int* stop;
+    int failures;
+} scorer_arg;
 
-    // Second pass: read data
-    if (has_header) fgets(line, sizeof(line), file);
-    int idx = 0;
-    while (fgets(line, sizeof(line), file)) {
-        char* token = strtok(line, ",");
-        // double* point = &(data->data[idx * data->strides[0]]);
-        for (int i = 0; i < *num_features; i++) {
-            // point[i]              = atof(token);
-            float p               = atof(token);
-            token                 = strtok(NULL, ",");
-            uint64_t npos[2] = {idx, i};
-            ndarray_set_point_f(data, npos, p);
-            // printf("idx[%d], point[%d] %1.3f\n", idx, i, point[i]);
+static void* score_loop(void* arg)
+{
+    scorer_arg* scorer = (scorer_arg*)arg;
+    while (!atomic_load(scorer->stop)) {
+        for (uint64_t i = 0; i < scorer->data->dimensions[0]; i++) {
+            uint64_t npos[2] = {i, 0};
+            double score     = iforest_score_f(scorer->forest, ndarray_get_point(scorer->data, npos));
+            if (!(score > 0 && score < 1)) scorer->failures++;
         }
-        idx++;
     }
-
-    fclose(file);
-    return data;
+    return NULL;
 }
 
 int main(int argc, const char *argv[])
@@ -83,8 +92,10 @@ int main(int argc, const char *argv[])
 
     // Load data
     srand(time(NULL));
-    int num_samples, num_features;
-    ndarray_t* data = load_csv(file, &num_samples, &num_features);
+    ndarray_t* data = ndarray_from_csv(file, 'f');
+    CHECK_PTR(data);
+    int num_samples  = (int)data->dimensions[0];
+    int num_features = (int)data->dimensions[1];
     printf("Loaded %d samples with %d features\n", num_samples, num_features);
     printf("ndarray dimensions[%u] shape(%llu, %llu)\n", data->nd, data->dimensions[0], data->dimensions[1]);
     printf("ndarray stride(%llu, %llu) \n", data->strides[0], data->strides[1]);
@@ -99,27 +110,810 @@ int main(int argc, const char *argv[])
         printf("\n");
     }
 
+    // CSV parsing: header, CRLF, blank lines, no final newline, values strtod must round
+    ndarray_t* csv = csv_roundtrip("test_parse.csv", "a,b,c\r\n1,-2.5,+3e2\r\n\n  0.1 , 1e-30,nan\n"
+                                                     "0.30000000000000004,,-0\n12345678901234567890,4.9e-324,.5");
+    double parsed[12] = {1, -2.5, 300, 0.1, 1e-30, NAN, 0.30000000000000004, NAN, -0.0, 12345678901234567890.0, 4.9e-324, 0.5};
+    if (csv == NULL || csv->dimensions[0] != 4 || csv->dimensions[1] != 3) {
+        fprintf(stderr, "ndarray_from_csv got the wrong shape\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 12; i++) {
+        double value = ((double*)csv->data)[i];
+        if (isnan(parsed[i]) ? !isnan(value) : (value != parsed[i] || signbit(value) != signbit(parsed[i]))) {
+            fprintf(stderr, "ndarray_from_csv parsed field %d as %.17g\n", i, value);
+            exit(EXIT_FAILURE);
+        }
+    }
+    ndarray_free(csv);
+    // Fields longer than the stack copy, like the exact expansion of the double nearest 0.1
+    // padded to 80 characters, still parse
+    csv = csv_roundtrip("test_parse.csv", "x,y\n0.100000000000000005551115123125782702118158340454101562500000000000000000000000,7\n");
+    if (csv == NULL || ((double*)csv->data)[0] != 0.1 || ((double*)csv->data)[1] != 7) {
+        fprintf(stderr, "ndarray_from_csv rejected or misread a long field\n");
+        exit(EXIT_FAILURE);
+    }
+    ndarray_free(csv);
+    if (csv_roundtrip("test_parse.csv", "1,2\n3,x\n") != NULL || csv_roundtrip("test_parse.csv", "1,2\n3,4,5\n") != NULL) {
+        fprintf(stderr, "ndarray_from_csv accepted a malformed row\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // A few MB, so rows are split over several chunks, must read back every printed double
+    FILE* csv_file = fopen("test_chunks.csv", "w");
+    CHECK_PTR(csv_file);
+    fprintf(csv_file, "x,y,z\n");
+    for (int i = 0; i < 3 * 60000; i++) {
+        double value = (rand() - RAND_MAX / 2) * pow(10, rand() % 40 - 20) / RAND_MAX;
+        fprintf(csv_file, (i % 3 == 2) ? "%.17g\n" : "%.17g,", value);
+    }
+    fclose(csv_file);
+    csv            = ndarray_from_csv("test_chunks.csv", 'd');
+    csv_file       = fopen("test_chunks.csv", "r");
+    int csv_errors = (csv == NULL || csv->dimensions[0] != 60000);
+    char line[256];
+    fgets(line, sizeof(line), csv_file);
+    for (int i = 0; i < 60000 && !csv_errors; i++) {
+        fgets(line, sizeof(line), csv_file);
+        char* field = line;
+        for (int j = 0; j < 3; j++) {
+            csv_errors += (strtod(field, &field) != ((double*)csv->data)[3 * i + j]);
+            field++;
+        }
+    }
+    fclose(csv_file);
+    remove("test_chunks.csv");
+    if (csv_errors) {
+        fprintf(stderr, "ndarray_from_csv does not match strtod across chunks\n");
+        exit(EXIT_FAILURE);
+    }
+    ndarray_free(csv);
+
+    // .npy round trip: the loaded array maps the file, copy-on-write
+    if (ndarray_save(data, "test_data.npy") != 0) {
+        fprintf(stderr, "ndarray_save failed\n");
+        exit(EXIT_FAILURE);
+    }
+    ndarray_t* npy = ndarray_load("test_data.npy");
+    if (npy == NULL || npy->owner != NDARRAY_OWNER_MMAP || npy->dtype != 'f' || npy->nd != 2 ||
+        npy->dimensions[0] != data->dimensions[0] || npy->dimensions[1] != data->dimensions[1] ||
+        memcmp(npy->data, data->data, ndarray_size(data) * sizeof(float)) != 0) {
+        fprintf(stderr, "ndarray_load does not match the saved array\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t npy_pos[2] = {0, 0};
+    ndarray_set_point_f(npy, npy_pos, 1e9f);
+    ndarray_free(npy);
+    npy = ndarray_load("test_data.npy");
+    CHECK_PTR(npy);
+    if (*(float*)ndarray_get_point(npy, npy_pos) != *(float*)ndarray_get_point(data, npy_pos)) {
+        fprintf(stderr, "writes to a loaded .npy array reached the file\n");
+        exit(EXIT_FAILURE);
+    }
+    ndarray_free(npy);
+    remove("test_data.npy");
+
+    // Headers as NumPy writes them: version 2.0 with a 1-d '<i8' shape, then files that must
+    // be refused: Fortran order, a shape whose byte count wraps to fit the 24 data bytes, and
+    // zero or negative dimensions
+    const char* npy_headers[5] = {"{'descr': '<i8', 'fortran_order': False, 'shape': (3,), }",
+                                  "{'descr': '<f8', 'fortran_order': True, 'shape': (1, 3), }",
+                                  "{'descr': '<i8', 'fortran_order': False, 'shape': (2305843009213693953, 1), }",
+                                  "{'descr': '<i8', 'fortran_order': False, 'shape': (0, 3), }",
+                                  "{'descr': '<i8', 'fortran_order': False, 'shape': (-1,), }"};
+    for (int k = 0; k < 5; k++) {
+        FILE* npy_file = fopen("test_header.npy", "wb");
+        CHECK_PTR(npy_file);
+        uint32_t header_len = 116;
+        fwrite(k == 0 ? "\x93NUMPY\x02\x00" : "\x93NUMPY\x01\x00", 1, 8, npy_file);
+        fwrite(&header_len, 1, k == 0 ? 4 : 2, npy_file);
+        fprintf(npy_file, "%-*s\n", (int)header_len - 1, npy_headers[k]);
+        uint64_t cells[3] = {7, 8, 9};
+        fwrite(cells, sizeof(cells), 1, npy_file);
+        fclose(npy_file);
+        npy = ndarray_load("test_header.npy");
+        remove("test_header.npy");
+        int ok = (k == 0) ? (npy && npy->dtype == 'i' && npy->nd == 1 && npy->dimensions[0] == 3 && ((uint64_t*)npy->data)[2] == 9)
+                          : (npy == NULL);
+        if (!ok) {
+            fprintf(stderr, "ndarray_load misread a NumPy header\n");
+            exit(EXIT_FAILURE);
+        }
+        if (npy) ndarray_free(npy);
+    }
+
+    // Views: a strided row slice, and the transpose of a transposed copy, which reads the
+    // original values through column-major strides
+    ndarray_t* every_third = ndarray_slice(data, 0, 10, 50, 3);
+    ndarray_t* transposed  = ndarray_transpose(data);
+    CHECK_PTR(every_third);
+    CHECK_PTR(transposed);
+    ndarray_t* columns      = ndarray_copy(transposed);
+    CHECK_PTR(columns);
+    ndarray_t* column_major = ndarray_transpose(columns);
+    CHECK_PTR(column_major);
+    int view_errors = (every_third->dimensions[0] != 14 || every_third->owner != NDARRAY_OWNER_NONE ||
+                       transposed->dimensions[0] != data->dimensions[1] || ndarray_is_contiguous(transposed) ||
+                       !ndarray_is_contiguous(columns) || ndarray_is_contiguous(column_major));
+    for (int i = 0; i < num_samples && !view_errors; i++) {
+        for (int j = 0; j < num_features; j++) {
+            uint64_t pos[2]  = {i, j};
+            uint64_t tpos[2] = {j, i};
+            float value      = *(float*)ndarray_get_point(data, pos);
+            view_errors += (*(float*)ndarray_get_point(columns, tpos) != value || *(float*)ndarray_get_point(column_major, pos) != value);
+            if (i < 14) {
+                uint64_t spos[2] = {10 + 3 * i, j};
+                view_errors += (*(float*)ndarray_get_point(every_third, pos) != *(float*)ndarray_get_point(data, spos));
+            }
+        }
+    }
+    if (ndarray_save(transposed, "test_view.npy") != 0 || (npy = ndarray_load("test_view.npy")) == NULL ||
+        memcmp(npy->data, columns->data, ndarray_size(columns) * sizeof(float)) != 0) {
+        view_errors++;
+    }
+    if (npy) ndarray_free(npy);
+    remove("test_view.npy");
+    if (view_errors) {
+        fprintf(stderr, "ndarray views do not read the viewed array\n");
+        exit(EXIT_FAILURE);
+    }
+    ndarray_free(every_third);
+    ndarray_free(transposed);
+
+    // Matrix product against a plain triple loop: sizes cross the packing blocks and leave
+    // partial tiles, b is a transposed view and the result is (m, n)
+    for (int k = 0; k < 2; k++) {
+        char dtype         = k ? 'f' : 'd';
+        ndarray_t* left    = ndarray_random_noise(67, 300, 0, 1, dtype);
+        ndarray_t* right_t = ndarray_random_noise(45, 300, 0, 1, dtype);
+        CHECK_PTR(left);
+        CHECK_PTR(right_t);
+        ndarray_t* right = ndarray_transpose(right_t);
+        CHECK_PTR(right);
+        ndarray_t* product = ndarray_dot(NULL, left, right);
+        if (product == NULL || product->dimensions[0] != 67 || product->dimensions[1] != 45) {
+            fprintf(stderr, "ndarray_dot returned the wrong shape\n");
+            exit(EXIT_FAILURE);
+        }
+        double max_error = 0;
+        for (uint64_t i = 0; i < 67; i++) {
+            for (uint64_t j = 0; j < 45; j++) {
+                double expected = 0;
+                for (uint64_t p = 0; p < 300; p++) {
+                    uint64_t lpos[2] = {i, p};
+                    uint64_t rpos[2] = {p, j};
+                    expected += k ? (double)*(float*)ndarray_get_point(left, lpos) * *(float*)ndarray_get_point(right, rpos)
+                                  : *(double*)ndarray_get_point(left, lpos) * *(double*)ndarray_get_point(right, rpos);
+                }
+                uint64_t cpos[2] = {i, j};
+                double value     = k ? *(float*)ndarray_get_point(product, cpos) : *(double*)ndarray_get_point(product, cpos);
+                max_error        = fmax(max_error, fabs(value - expected));
+            }
+        }
+        if (max_error > (k ? 1e-3 : 1e-10)) {
+            fprintf(stderr, "ndarray_dot '%c' is off by %g\n", dtype, max_error);
+            exit(EXIT_FAILURE);
+        }
+        ndarray_free(product);
+        ndarray_free(right);
+        ndarray_free(right_t);
+        ndarray_free(left);
+    }
+
+    // Products large enough for the shared pool, run from several threads at once, must
+    // match one run alone: each element is summed in the same order on any worker
+    {
+        ndarray_t* left  = ndarray_random_noise(512, 128, 0, 1, 'd');
+        ndarray_t* right = ndarray_random_noise(128, 64, 0, 1, 'd');
+        CHECK_PTR(left);
+        CHECK_PTR(right);
+        ndarray_t* alone = ndarray_dot(NULL, left, right);
+        CHECK_PTR(alone);
+        pthread_t threads[4];
+        dot_arg dots[4];
+        for (int t = 0; t < 4; t++) {
+            dots[t] = (dot_arg){left, right, NULL};
+            pthread_create(&threads[t], NULL, dot_thread, &dots[t]);
+        }
+        int dot_errors = 0;
+        for (int t = 0; t < 4; t++) {
+            pthread_join(threads[t], NULL);
+            dot_errors += (dots[t].product == NULL || memcmp(dots[t].product->data, alone->data, 512 * 64 * sizeof(double)) != 0);
+            if (dots[t].product) ndarray_free(dots[t].product);
+        }
+        if (dot_errors) {
+            fprintf(stderr, "concurrent ndarray_dot calls differ from a single call\n");
+            exit(EXIT_FAILURE);
+        }
+        ndarray_free(alone);
+        ndarray_free(right);
+        ndarray_free(left);
+    }
+
     // Initialize and train forest
     isolation_forest* forest = iforest_init(100, 256, num_features, 4, 0, 42);
     iforest_train(forest, data);
 
-    FILE* output = fopen("c_scores.txt", "w");
+    double* scores = malloc(num_samples * sizeof(double));
+    CHECK_PTR(scores);
+    if (iforest_score_batch(forest, data, scores) != 0) {
+        fprintf(stderr, "iforest_score_batch failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Float rows too far apart for 32-bit gather offsets within a tile, read in place from
+    // a sparse mapping, must score like single points on both plain and extended models
+    uint64_t far_stride = (uint64_t)70000000 * sizeof(float);
+    size_t far_bytes    = 32 * far_stride;
+    void* far_rows      = mmap(NULL, far_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (far_rows != MAP_FAILED) {
+        uint64_t far_dims[2]      = {32, num_features};
+        uint64_t far_strides[2]   = {far_stride, sizeof(float)};
+        ndarray_t* far            = ndarray_from_buffer(far_rows, 2, far_dims, far_strides, 'f', NULL);
+        isolation_forest* far_ext = iforest_init(100, 256, num_features, 1, 0, 42);
+        CHECK_PTR(far);
+        CHECK_PTR(far_ext);
+        iforest_set_extension_level(far_ext, num_features - 1);
+        iforest_train(far_ext, data);
+        for (int i = 0; i < 32; i++) {
+            uint64_t npos[2] = {i, 0};
+            memcpy((uint8_t*)far_rows + i * far_stride, ndarray_get_point(data, npos), num_features * sizeof(float));
+        }
+        isolation_forest* far_models[2] = {forest, far_ext};
+        double far_scores[32];
+        int far_errors = 0;
+        for (int k = 0; k < 2; k++) {
+            far_errors += (iforest_score_batch(far_models[k], far, far_scores) != 0);
+            for (int i = 0; i < 32; i++) {
+                far_errors += (far_scores[i] != iforest_score_f(far_models[k], (float*)((uint8_t*)far_rows + i * far_stride)));
+            }
+        }
+        if (far_errors) {
+            fprintf(stderr, "widely strided float rows scored wrong on %d rows\n", far_errors);
+            exit(EXIT_FAILURE);
+        }
+        iforest_free(far_ext);
+        ndarray_free(far);
+        munmap(far_rows, far_bytes);
+    }
+
+    // Same random_state must give the same forest whatever the thread count
+    isolation_forest* serial = iforest_init(100, 256, num_features, 1, 0, 42);
+    iforest_train(serial, data);
+    double* serial_scores = malloc(num_samples * sizeof(double));
+    CHECK_PTR(serial_scores);
+    iforest_score_batch(serial, data, serial_scores);
+    if (memcmp(scores, serial_scores, num_samples * sizeof(double)) != 0) {
+        fprintf(stderr, "training is not reproducible across num_threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Training and scoring through column-major strides must see the same rows
+    iforest_free(serial);
+    serial = iforest_init(100, 256, num_features, 1, 0, 42);
+    iforest_train(serial, column_major);
+    iforest_score_batch(serial, column_major, serial_scores);
+    if (memcmp(scores, serial_scores, num_samples * sizeof(double)) != 0) {
+        fprintf(stderr, "training on a strided view differs from training on the array\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Caller buffers, borrowed with explicit strides or adopted with a deleter, score in place
+    float* buffer = malloc(ndarray_size(data) * sizeof(float));
+    CHECK_PTR(buffer);
+    memcpy(buffer, data->data, ndarray_size(data) * sizeof(float));
+    ndarray_t* borrowed = ndarray_from_buffer(data->data, 2, data->dimensions, data->strides, 'f', NULL);
+    ndarray_t* adopted  = ndarray_from_buffer(buffer, 2, data->dimensions, NULL, 'f', release_buffer);
+    CHECK_PTR(borrowed);
+    CHECK_PTR(adopted);
+    for (int k = 0; k < 2; k++) {
+        iforest_score_batch(forest, k == 0 ? borrowed : adopted, serial_scores);
+        if (memcmp(scores, serial_scores, num_samples * sizeof(double)) != 0) {
+            fprintf(stderr, "scores over a wrapped buffer differ\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ndarray_free(borrowed);
+    ndarray_free(adopted);
+    if (buffers_released != 1) {
+        fprintf(stderr, "ndarray_free did not release exactly the adopted buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    free(serial_scores);
+    iforest_free(serial);
+    ndarray_free(column_major);
+    ndarray_free(columns);
+
+    // Trees large enough to be split into subtree tasks must be reproducible too
+    ndarray_t* large = ndarray_random_noise(40000, num_features, 0, 1, 'f');
+    CHECK_PTR(large);
+    double* large_scores[2];
+    for (int k = 0; k < 2; k++) {
+        isolation_forest* big = iforest_init(4, 40000, num_features, k == 0 ? 1 : 4, 0, 7);
+        iforest_train(big, large);
+        large_scores[k] = malloc(num_samples * sizeof(double));
+        CHECK_PTR(large_scores[k]);
+        iforest_score_batch(big, data, large_scores[k]);
+        iforest_free(big);
+    }
+    if (memcmp(large_scores[0], large_scores[1], num_samples * sizeof(double)) != 0) {
+        fprintf(stderr, "subtree tasks are not reproducible across num_threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // A single large tree must still be shared: workers with no tree of their own wait for
+    // the subtrees its partition spawns
+    ndarray_t* huge = ndarray_random_noise(400000, num_features, 0, 1, 'f');
+    CHECK_PTR(huge);
+    isolation_forest* lone = iforest_init(1, 400000, num_features, 4, 0, 7);
+    iforest_train(lone, huge);
+    if (iforest_subtree_workers(lone) < 2) {
+        fprintf(stderr, "subtree tasks of a single tree ran on %d worker(s)\n", iforest_subtree_workers(lone));
+        exit(EXIT_FAILURE);
+    }
+    iforest_free(lone);
+    ndarray_free(huge);
+
+    // Histogram training: reproducible with and without subtree tasks, and the 100-tree
+    // forest must score close to the exact one
+    double* hist_scores[2];
+    for (int k = 0; k < 2; k++) {
+        isolation_forest* binned = iforest_init(100, 256, num_features, k == 0 ? 1 : 4, 0, 42);
+        isolation_forest* big    = iforest_init(4, 40000, num_features, k == 0 ? 1 : 4, 0, 7);
+        if (iforest_set_histogram(binned, 256) != 0 || iforest_set_histogram(big, 256) != 0) {
+            fprintf(stderr, "iforest_set_histogram rejected a valid bin count\n");
+            exit(EXIT_FAILURE);
+        }
+        iforest_train(binned, data);
+        iforest_train(big, large);
+        hist_scores[k] = malloc(2 * num_samples * sizeof(double));
+        CHECK_PTR(hist_scores[k]);
+        iforest_score_batch(binned, data, hist_scores[k]);
+        iforest_score_batch(big, data, hist_scores[k] + num_samples);
+        iforest_free(binned);
+        iforest_free(big);
+    }
+    if (memcmp(hist_scores[0], hist_scores[1], 2 * num_samples * sizeof(double)) != 0) {
+        fprintf(stderr, "histogram training is not reproducible across num_threads\n");
+        exit(EXIT_FAILURE);
+    }
+    double hist_error = 0;
+    for (int i = 0; i < num_samples; i++) {
+        hist_error = fmax(hist_error, fabs(hist_scores[0][i] - scores[i]));
+    }
+    printf("histogram training max score difference: %f\n", hist_error);
+    if (hist_error > 0.1 || iforest_set_histogram(forest, 1) != -1 || iforest_set_histogram(forest, 257) != -1) {
+        fprintf(stderr, "histogram training is off or accepted an invalid bin count\n");
+        exit(EXIT_FAILURE);
+    }
+    free(hist_scores[0]);
+    free(hist_scores[1]);
+    free(large_scores[0]);
+    free(large_scores[1]);
+    ndarray_free(large);
+
+    FILE* output   = fopen("c_scores.txt", "w");
+    int mismatches = 0;
+    double point[num_features];
     for (int i = 0; i < num_samples; i++) {
         printf("infer point[%d] ", i);
         for (int j = 0; j < num_features; j++) {
             uint64_t npos[2] = {i, j};
-            float p          = *(float *)ndarray_get_point(data, npos);
-            printf("%.3f ", p);
+            point[j]         = *(float *)ndarray_get_point(data, npos);
+            printf("%.3f ", point[j]);
         }
         printf("\n");
+        // batch scoring must agree with the single point paths of both dtypes
         uint64_t npos[2] = {i, 0};
-        float* point     = ndarray_get_point(data, npos);
         double score     = iforest_score(forest, point);
-        fprintf(output, "%.6f\n", score);
-        printf("Score %d: %.6f\n", i, score);
+        double score_f   = iforest_score_f(forest, ndarray_get_point(data, npos));
+        if (score != scores[i] || score_f != scores[i]) mismatches++;
+        fprintf(output, "%.6f\n", scores[i]);
+        printf("Score %d: %.6f\n", i, scores[i]);
     }
     fclose(output);
 
+    if (mismatches) {
+        fprintf(stderr, "batch/single score mismatch on %d points\n", mismatches);
+        exit(EXIT_FAILURE);
+    }
+
+    // Early-terminated predictions must agree with the full score on both sides of the threshold
+    double thresholds[3] = {0.55, 0.6, 0.7};
+    for (int k = 0; k < 3; k++) {
+        long trees_walked = 0;
+        for (int i = 0; i < num_samples; i++) {
+            for (int j = 0; j < num_features; j++) {
+                uint64_t npos[2] = {i, j};
+                point[j]         = *(float *)ndarray_get_point(data, npos);
+            }
+            int trees_evaluated;
+            int label = iforest_predict(forest, point, thresholds[k], &trees_evaluated);
+            if (label != (scores[i] > thresholds[k] ? -1 : 1)) mismatches++;
+            trees_walked += trees_evaluated;
+        }
+        printf("predict threshold %.2f: %.1f trees per point\n", thresholds[k], (double)trees_walked / num_samples);
+    }
+    if (mismatches) {
+        fprintf(stderr, "iforest_predict disagrees with iforest_score on %d points\n", mismatches);
+        exit(EXIT_FAILURE);
+    }
+
+    // Contamination is 0 for "auto" or a share in (0, 0.5], anything else is refused
+    double bad_contamination[3] = {0.7, -0.1, NAN};
+    for (int k = 0; k < 3; k++) {
+        isolation_forest* refused = iforest_init(100, 256, num_features, 1, bad_contamination[k], 42);
+        if (refused != NULL) {
+            fprintf(stderr, "iforest_init accepted contamination %g\n", bad_contamination[k]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Contamination fits the threshold to the matching quantile of the training scores
+    isolation_forest* fitted = iforest_init(100, 256, num_features, 4, 0.01, 42);
+    CHECK_PTR(fitted);
+    iforest_train(fitted, data);
+    double* sorted = malloc(num_samples * sizeof(double));
+    int* labels    = malloc(num_samples * sizeof(int));
+    CHECK_PTR(sorted);
+    CHECK_PTR(labels);
+    iforest_score_batch(fitted, data, sorted);
+    if (iforest_predict_batch(fitted, data, labels) != 0) {
+        fprintf(stderr, "iforest_predict_batch failed\n");
+        exit(EXIT_FAILURE);
+    }
+    double threshold = iforest_threshold(fitted);
+    int anomalies    = 0;
+    for (int i = 0; i < num_samples; i++) {
+        if (labels[i] != (sorted[i] > threshold ? -1 : 1)) mismatches++;
+        if (labels[i] == -1) anomalies++;
+    }
+    qsort(sorted, num_samples, sizeof(double), compare_double);
+    double pos      = 0.99 * (num_samples - 1);
+    int k           = (int)pos;
+    double expected = sorted[k] + (pos - k) * (sorted[k + 1] - sorted[k]);
+    printf("contamination 0.01: threshold %.6f, %d anomalies\n", threshold, anomalies);
+    if (mismatches || threshold != expected || anomalies > (num_samples + 99) / 100) {
+        fprintf(stderr, "contamination threshold %.6f (expected %.6f), %d label mismatches\n", threshold, expected, mismatches);
+        exit(EXIT_FAILURE);
+    }
+    free(sorted);
+    free(labels);
+    iforest_free(fitted);
+
+    // Saved models must score the same, both copied and mapped
+    const char* model_file = "iforest_model.bin";
+    if (iforest_save(forest, model_file) != 0) {
+        fprintf(stderr, "iforest_save failed\n");
+        exit(EXIT_FAILURE);
+    }
+    isolation_forest* loaded[2] = {iforest_load(model_file), iforest_load_mmap(model_file)};
+    double* loaded_scores       = malloc(num_samples * sizeof(double));
+    CHECK_PTR(loaded_scores);
+    for (int k = 0; k < 2; k++) {
+        CHECK_PTR(loaded[k]);
+        iforest_score_batch(loaded[k], data, loaded_scores);
+        if (memcmp(scores, loaded_scores, num_samples * sizeof(double)) != 0) {
+            fprintf(stderr, "%s model scores differ from the trained model\n", k == 0 ? "loaded" : "mapped");
+            exit(EXIT_FAILURE);
+        }
+        iforest_free(loaded[k]);
+    }
+    free(loaded_scores);
+    remove(model_file);
+
+    // A corrupt node must be refused by both loaders: every word of a one-tree model past
+    // its header is overwritten in turn with an index far outside the model
+    isolation_forest* small = iforest_init(1, 256, num_features, 1, 0, 42);
+    CHECK_PTR(small);
+    iforest_train(small, data);
+    if (iforest_save(small, model_file) != 0) {
+        fprintf(stderr, "iforest_save failed for a one-tree model\n");
+        exit(EXIT_FAILURE);
+    }
+    iforest_free(small);
+    FILE* model_fp = fopen(model_file, "rb");
+    CHECK_PTR(model_fp);
+    fseek(model_fp, 0, SEEK_END);
+    long model_bytes = ftell(model_fp);
+    uint8_t* image   = malloc(model_bytes);
+    CHECK_PTR(image);
+    fseek(model_fp, 0, SEEK_SET);
+    if (fread(image, 1, model_bytes, model_fp) != (size_t)model_bytes) {
+        fprintf(stderr, "could not read back the saved model\n");
+        exit(EXIT_FAILURE);
+    }
+    fclose(model_fp);
+    int corrupt_refused = 0;
+    int corrupt_errors  = 0;
+    for (long at = 1024; at + 4 <= model_bytes; at += 4) {
+        int32_t word;
+        int32_t hostile = 0x7FFFFFF0;
+        memcpy(&word, image + at, 4);
+        memcpy(image + at, &hostile, 4);
+        model_fp = fopen(model_file, "wb");
+        CHECK_PTR(model_fp);
+        fwrite(image, 1, model_bytes, model_fp);
+        fclose(model_fp);
+        memcpy(image + at, &word, 4);
+        isolation_forest* corrupt[2] = {iforest_load(model_file), iforest_load_mmap(model_file)};
+        corrupt_errors += ((corrupt[0] == NULL) != (corrupt[1] == NULL));
+        corrupt_refused += (corrupt[1] == NULL);
+        for (int k = 0; k < 2; k++) {
+            if (corrupt[k] == NULL) continue;
+            uint64_t npos[2] = {0, 0};
+            iforest_score_f(corrupt[k], ndarray_get_point(data, npos));
+            iforest_free(corrupt[k]);
+        }
+    }
+    free(image);
+    remove(model_file);
+    if (corrupt_errors || corrupt_refused == 0) {
+        fprintf(stderr, "loaders disagree on %d corrupt models, %d refused\n", corrupt_errors, corrupt_refused);
+        exit(EXIT_FAILURE);
+    }
+
+    // Extended splits: batch kernels must match the single-point walk, training must be
+    // reproducible across num_threads and saved models must score the same
+    ndarray_t* ext_sets[2] = {data, ndarray_random_noise(2000, num_features, 0, 1, 'd')};
+    CHECK_PTR(ext_sets[1]);
+    for (int s = 0; s < 2; s++) {
+        ndarray_t* X      = ext_sets[s];
+        int rows          = (int)X->dimensions[0];
+        double* ext_batch = malloc(rows * sizeof(double));
+        double* ext_check = malloc(rows * sizeof(double));
+        CHECK_PTR(ext_batch);
+        CHECK_PTR(ext_check);
+        isolation_forest* ext[2];
+        for (int k = 0; k < 2; k++) {
+            ext[k] = iforest_init(100, 256, num_features, k == 0 ? 1 : 4, 0, 42);
+            CHECK_PTR(ext[k]);
+            if (iforest_set_extension_level(ext[k], num_features - 1) != 0) {
+                fprintf(stderr, "iforest_set_extension_level rejected a valid level\n");
+                exit(EXIT_FAILURE);
+            }
+            iforest_train(ext[k], X);
+            iforest_score_batch(ext[k], X, k == 0 ? ext_batch : ext_check);
+        }
+        if (memcmp(ext_batch, ext_check, rows * sizeof(double)) != 0) {
+            fprintf(stderr, "extended training is not reproducible across num_threads\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < rows; i++) {
+            uint64_t npos[2] = {i, 0};
+            void* row        = ndarray_get_point(X, npos);
+            double single    = (X->dtype == 'f') ? iforest_score_f(ext[1], row) : iforest_score(ext[1], row);
+            if (single != ext_batch[i]) mismatches++;
+        }
+        if (mismatches) {
+            fprintf(stderr, "extended batch scores differ from single points on %d rows\n", mismatches);
+            exit(EXIT_FAILURE);
+        }
+        if (iforest_save(ext[1], model_file) != 0) {
+            fprintf(stderr, "iforest_save failed for an extended model\n");
+            exit(EXIT_FAILURE);
+        }
+        isolation_forest* ext_loaded[2] = {iforest_load(model_file), iforest_load_mmap(model_file)};
+        for (int k = 0; k < 2; k++) {
+            CHECK_PTR(ext_loaded[k]);
+            iforest_score_batch(ext_loaded[k], X, ext_check);
+            if (memcmp(ext_batch, ext_check, rows * sizeof(double)) != 0) {
+                fprintf(stderr, "%s extended model scores differ from the trained model\n", k == 0 ? "loaded" : "mapped");
+                exit(EXIT_FAILURE);
+            }
+            iforest_free(ext_loaded[k]);
+        }
+        remove(model_file);
+        iforest_free(ext[0]);
+        iforest_free(ext[1]);
+        free(ext_batch);
+        free(ext_check);
+    }
+    ndarray_free(ext_sets[1]);
+
+    // Quantized models: with enough bins every split stays exact and only the 16-bit leaf
+    // lengths move scores, coarse bins cost accuracy. Batch, single point, labels and saved
+    // copies must agree with each other either way.
+    int bin_counts[2] = {65536, 16};
+    for (int b = 0; b < 2; b++) {
+        isolation_forest* quant = iforest_init(100, 256, num_features, 4, 0.01, 42);
+        CHECK_PTR(quant);
+        iforest_train(quant, data);
+        double* full_scores  = malloc(num_samples * sizeof(double));
+        double* quant_scores = malloc(num_samples * sizeof(double));
+        int* quant_labels    = malloc(num_samples * sizeof(int));
+        CHECK_PTR(full_scores);
+        CHECK_PTR(quant_scores);
+        CHECK_PTR(quant_labels);
+        iforest_score_batch(quant, data, full_scores);
+        if (iforest_quantize(quant, bin_counts[b]) != 0 || iforest_quantize(quant, bin_counts[b]) != -1) {
+            fprintf(stderr, "iforest_quantize must quantize a full model once\n");
+            exit(EXIT_FAILURE);
+        }
+        iforest_score_batch(quant, data, quant_scores);
+        iforest_predict_batch(quant, data, quant_labels);
+
+        double max_error = 0;
+        for (int i = 0; i < num_samples; i++) {
+            double error = fabs(quant_scores[i] - full_scores[i]);
+            max_error    = (error > max_error) ? error : max_error;
+            for (int j = 0; j < num_features; j++) {
+                uint64_t npos[2] = {i, j};
+                point[j]         = *(float*)ndarray_get_point(data, npos);
+            }
+            uint64_t npos[2] = {i, 0};
+            if (iforest_score_f(quant, ndarray_get_point(data, npos)) != quant_scores[i]) mismatches++;
+            if (iforest_predict(quant, point, 0.6, NULL) != (quant_scores[i] > 0.6 ? -1 : 1)) mismatches++;
+            if (quant_labels[i] != (quant_scores[i] > iforest_threshold(quant) ? -1 : 1)) mismatches++;
+        }
+        printf("quantized to %d bins: max score error %.6f\n", bin_counts[b], max_error);
+        if (mismatches || (b == 0 && max_error > 1e-4)) {
+            fprintf(stderr, "quantized model: %d mismatches, max score error %.6f\n", mismatches, max_error);
+            exit(EXIT_FAILURE);
+        }
+
+        if (iforest_save(quant, model_file) != 0) {
+            fprintf(stderr, "iforest_save failed for a quantized model\n");
+            exit(EXIT_FAILURE);
+        }
+        isolation_forest* quant_loaded[2] = {iforest_load(model_file), iforest_load_mmap(model_file)};
+        for (int k = 0; k < 2; k++) {
+            CHECK_PTR(quant_loaded[k]);
+            iforest_score_batch(quant_loaded[k], data, full_scores);
+            if (memcmp(quant_scores, full_scores, num_samples * sizeof(double)) != 0) {
+                fprintf(stderr, "%s quantized model scores differ from the quantized model\n", k == 0 ? "loaded" : "mapped");
+                exit(EXIT_FAILURE);
+            }
+            iforest_free(quant_loaded[k]);
+        }
+        remove(model_file);
+        iforest_free(quant);
+        free(full_scores);
+        free(quant_scores);
+        free(quant_labels);
+    }
+
+    // Rows wider than the stack bins of the single point paths are binned split by split
+    {
+        int rows                = 200;
+        int wide                = 1100;
+        ndarray_t* X            = ndarray_random_noise(rows, wide, 0, 1, 'd');
+        isolation_forest* quant = iforest_init(50, 128, wide, 2, 0, 42);
+        double* wide_scores     = malloc(rows * sizeof(double));
+        CHECK_PTR(X);
+        CHECK_PTR(quant);
+        CHECK_PTR(wide_scores);
+        iforest_train(quant, X);
+        if (iforest_quantize(quant, 256) != 0) {
+            fprintf(stderr, "iforest_quantize failed for a wide model\n");
+            exit(EXIT_FAILURE);
+        }
+        iforest_score_batch(quant, X, wide_scores);
+        for (int i = 0; i < rows; i++) {
+            uint64_t npos[2] = {i, 0};
+            double* row      = ndarray_get_point(X, npos);
+            if (iforest_score(quant, row) != wide_scores[i]) mismatches++;
+            if (iforest_predict(quant, row, 0.5, NULL) != (wide_scores[i] > 0.5 ? -1 : 1)) mismatches++;
+        }
+        if (mismatches) {
+            fprintf(stderr, "wide quantized rows: %d single point mismatches\n", mismatches);
+            exit(EXIT_FAILURE);
+        }
+        iforest_free(quant);
+        ndarray_free(X);
+        free(wide_scores);
+    }
+
+    // Incremental training from batches, scored while the updater rebuilds trees.
+    // Applying every batch before the next one must be reproducible.
+    double* stream_scores[2];
+    for (int k = 0; k < 2; k++) {
+        isolation_forest* online = iforest_init(100, 256, num_features, 2, 0, 42);
+        CHECK_PTR(online);
+        if (iforest_set_window(online, num_samples, 10) != 0) {
+            fprintf(stderr, "iforest_set_window failed\n");
+            exit(EXIT_FAILURE);
+        }
+        stream_scores[k] = malloc(num_samples * sizeof(double));
+        CHECK_PTR(stream_scores[k]);
+        for (int start = 0; start < num_samples; start += 200) {
+            ndarray_t* batch = ndarray_slice(data, 0, start, start + 200 < num_samples ? start + 200 : num_samples, 1);
+            CHECK_PTR(batch);
+            int status = iforest_partial_fit(online, batch);
+            ndarray_free(batch);
+            if (status != 0) {
+                fprintf(stderr, "iforest_partial_fit failed\n");
+                exit(EXIT_FAILURE);
+            }
+            iforest_score_batch(online, data, stream_scores[k]);
+            iforest_flush(online);
+        }
+        iforest_score_batch(online, data, stream_scores[k]);
+        for (int i = 0; i < num_samples; i++) {
+            if (!(stream_scores[k][i] > 0 && stream_scores[k][i] < 1)) {
+                fprintf(stderr, "incremental model gave score %f for point %d\n", stream_scores[k][i], i);
+                exit(EXIT_FAILURE);
+            }
+        }
+        iforest_free(online);
+    }
+    if (memcmp(stream_scores[0], stream_scores[1], num_samples * sizeof(double)) != 0) {
+        fprintf(stderr, "incremental training is not reproducible\n");
+        exit(EXIT_FAILURE);
+    }
+    free(stream_scores[0]);
+    free(stream_scores[1]);
+
+    // Retraining and publishing while other threads score the same forest
+    atomic_int stop = 0;
+    pthread_t scorers[2];
+    scorer_arg scorer_args[2];
+    for (int k = 0; k < 2; k++) {
+        scorer_args[k] = (scorer_arg){forest, data, &stop, 0};
+        pthread_create(&scorers[k], NULL, score_loop, &scorer_args[k]);
+    }
+    for (int round = 0; round < 4; round++) {
+        isolation_forest* next = iforest_init(100, 256, num_features, 1, 0, 100 + round);
+        CHECK_PTR(next);
+        iforest_train(next, data);
+        if (iforest_publish(forest, next) != 0) {
+            fprintf(stderr, "iforest_publish failed\n");
+            exit(EXIT_FAILURE);
+        }
+        iforest_free(next);
+        iforest_train(forest, data);
+    }
+    // A model over fewer features would read past the rows being scored
+    ndarray_t* narrow_data   = ndarray_slice(data, 1, 0, num_features - 1, 1);
+    isolation_forest* narrow = iforest_init(100, 256, num_features - 1, 1, 0, 42);
+    CHECK_PTR(narrow_data);
+    CHECK_PTR(narrow);
+    iforest_train(narrow, narrow_data);
+    if (iforest_publish(forest, narrow) != -1) {
+        fprintf(stderr, "iforest_publish accepted a model with a different num_features\n");
+        exit(EXIT_FAILURE);
+    }
+    iforest_free(narrow);
+    ndarray_free(narrow_data);
+
+    // Wider data must not reach the live model either: training refuses it, and a wider
+    // model loaded from a file is handed back to its forest instead of being published
+    ndarray_t* wide_data    = ndarray_random_noise(500, num_features + 47, 0, 1, 'd');
+    isolation_forest* wide  = iforest_init(100, 256, num_features, 1, 0, 42);
+    isolation_forest* grown = iforest_init(100, 256, num_features + 47, 1, 0, 42);
+    CHECK_PTR(wide_data);
+    CHECK_PTR(wide);
+    CHECK_PTR(grown);
+    iforest_train(wide, wide_data);
+    iforest_train(grown, wide_data);
+    if (iforest_save(grown, model_file) != 0) {
+        fprintf(stderr, "iforest_save failed for the wide model\n");
+        exit(EXIT_FAILURE);
+    }
+    iforest_free(grown);
+    grown = iforest_load(model_file);
+    remove(model_file);
+    CHECK_PTR(grown);
+    uint64_t wide_pos[2] = {0, 0};
+    double* wide_row     = ndarray_get_point(wide_data, wide_pos);
+    if (iforest_publish(forest, wide) != -1 || iforest_publish(forest, grown) != -1 ||
+        !(iforest_score(grown, wide_row) > 0 && iforest_score(grown, wide_row) < 1)) {
+        fprintf(stderr, "a model trained on wider data reached the forest\n");
+        exit(EXIT_FAILURE);
+    }
+    iforest_free(wide);
+    iforest_free(grown);
+    ndarray_free(wide_data);
+    atomic_store(&stop, 1);
+    for (int k = 0; k < 2; k++) {
+        pthread_join(scorers[k], NULL);
+        if (scorer_args[k].failures) {
+            fprintf(stderr, "%d bad scores while the model was replaced\n", scorer_args[k].failures);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(scores);
+
     // Cleanup memory
     iforest_free(forest);
     ndarray_free(data);